@@ -0,0 +1,54 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+
+#include <LoRaMac.h>
+
+#include "airtime.h"
+
+/* MHDR, FHDR without FOpts, FPort and MIC */
+#define FRAME_OVERHEAD		13
+#define PREAMBLE_SYMBOLS	8
+/* Coding rate 4/5 */
+#define CODING_RATE		1
+
+struct lora_modulation {
+	uint8_t sf;
+	uint16_t bw_khz;
+};
+
+/* Uplink datarates, Zephyr doesn't expose the region tables */
+static const struct lora_modulation datarates[] = {
+#if defined(CONFIG_LORAMAC_REGION_US915) || defined(CONFIG_LORAMAC_REGION_AU915)
+	{ 10, 125 }, { 9, 125 }, { 8, 125 }, { 7, 125 }, { 8, 500 },
+#else
+	{ 12, 125 }, { 11, 125 }, { 10, 125 }, { 9, 125 }, { 8, 125 }, { 7, 125 }, { 7, 250 },
+#endif
+};
+
+uint32_t lorawan_airtime_us(size_t len) {
+	MibRequestConfirm_t mib_req;
+	const struct lora_modulation *mod = &datarates[0];
+	int32_t num;
+	uint32_t payload_symbols = 0;
+	uint32_t symbol_us;
+	bool ldro;
+
+	mib_req.Type = MIB_CHANNELS_DATARATE;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) == LORAMAC_STATUS_OK &&
+	    mib_req.Param.ChannelsDatarate < ARRAY_SIZE(datarates)) {
+		mod = &datarates[mib_req.Param.ChannelsDatarate];
+	}
+
+	/* Low data rate optimization is on for symbols of 16 ms and longer */
+	ldro = mod->sf >= 11 && mod->bw_khz == 125;
+	symbol_us = (1U << mod->sf) * 1000U / mod->bw_khz;
+
+	/* SX127x datasheet, explicit header and CRC on */
+	num = 8 * (int32_t)(len + FRAME_OVERHEAD) - 4 * mod->sf + 28 + 16;
+	if (num > 0) {
+		payload_symbols = DIV_ROUND_UP(num, 4 * (mod->sf - 2 * ldro)) * (CODING_RATE + 4);
+	}
+
+	/* Preamble, 4.25 sync symbols and the 8 symbol header, in quarter symbols */
+	return symbol_us * (4 * (PREAMBLE_SYMBOLS + 4 + 8 + payload_symbols) + 1) / 4;
+}
@@ -0,0 +1,13 @@
+#ifndef __LORAWAN_AIRTIME_H__
+#define __LORAWAN_AIRTIME_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Time on air of an uplink with `len` bytes of application payload at the
+ * current datarate, not counting any MAC commands piggybacked in FOpts.
+ */
+uint32_t lorawan_airtime_us(size_t len);
+
+#endif
@@ -0,0 +1,80 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include <LoRaMac.h>
+#include <lw_priv.h>
+
+#include "class_b.h"
+
+LOG_MODULE_REGISTER(class_b, CONFIG_LORAWAN_LOG_LEVEL);
+
+/*
+ * Zephyr only supports class A and C, but the MAC implements class B when
+ * built with LORAMAC_CLASSB_ENABLED. This drives it through the MLME/MIB
+ * interface.
+ */
+
+int lorawan_class_b_request(uint8_t periodicity) {
+	LoRaMacStatus_t status;
+	MlmeReq_t mlme_req = { 0 };
+
+	/* The beacon search is much faster with a known network time */
+	mlme_req.Type = MLME_DEVICE_TIME;
+	status = LoRaMacMlmeRequest(&mlme_req);
+	if (status != LORAMAC_STATUS_OK) {
+		LOG_ERR("Device time request failed: %s", lorawan_status2str(status));
+		return lorawan_status2errno(status);
+	}
+
+	mlme_req.Type = MLME_PING_SLOT_INFO;
+	mlme_req.Req.PingSlotInfo.PingSlot.Fields.Periodicity = periodicity;
+	mlme_req.Req.PingSlotInfo.PingSlot.Fields.RFU = 0;
+	status = LoRaMacMlmeRequest(&mlme_req);
+	if (status != LORAMAC_STATUS_OK) {
+		LOG_ERR("Ping slot info request failed: %s", lorawan_status2str(status));
+		return lorawan_status2errno(status);
+	}
+
+	mlme_req.Type = MLME_BEACON_ACQUISITION;
+	status = LoRaMacMlmeRequest(&mlme_req);
+	if (status != LORAMAC_STATUS_OK) {
+		LOG_ERR("Beacon acquisition failed: %s", lorawan_status2str(status));
+		return lorawan_status2errno(status);
+	}
+
+	return 0;
+}
+
+int lorawan_class_b_enable(void) {
+	LoRaMacStatus_t status;
+	MibRequestConfirm_t mib_req;
+
+	mib_req.Type = MIB_DEVICE_CLASS;
+	mib_req.Param.Class = CLASS_B;
+	status = LoRaMacMibSetRequestConfirm(&mib_req);
+	if (status != LORAMAC_STATUS_OK) {
+		/* The MAC refuses until the beacon and ping slots are set up */
+		LOG_DBG("Class B not ready: %s", lorawan_status2str(status));
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+enum lorawan_class lorawan_class_get(void) {
+	MibRequestConfirm_t mib_req;
+
+	mib_req.Type = MIB_DEVICE_CLASS;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) != LORAMAC_STATUS_OK) {
+		return LORAWAN_CLASS_A;
+	}
+
+	switch (mib_req.Param.Class) {
+		case CLASS_B:
+			return LORAWAN_CLASS_B;
+		case CLASS_C:
+			return LORAWAN_CLASS_C;
+		default:
+			return LORAWAN_CLASS_A;
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef __LORAWAN_CLASS_B_H__
+#define __LORAWAN_CLASS_B_H__
+
+#include <stdint.h>
+#include <zephyr/lorawan/lorawan.h>
+
+/**
+ * Request the device time and ping slots every 2^`periodicity` seconds, and
+ * start searching for the beacon. The MAC commands go out with the next uplink.
+ */
+int lorawan_class_b_request(uint8_t periodicity);
+
+/**
+ * Switch from class A to class B. Returns -EAGAIN until the beacon is locked
+ * and the ping slots are confirmed.
+ */
+int lorawan_class_b_enable(void);
+
+/** The current device class, which Zephyr doesn't expose */
+enum lorawan_class lorawan_class_get(void);
+
+#endif
@@ -0,0 +1,116 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
+
+#include <string.h>
+
+#ifdef CONFIG_HAS_PSA_STORAGE_SE
+#include <psa/crypto.h>
+#else
+#include <cmac.h>
+#endif
+
+#include "app_protocol.h"
+#include "peer_auth.h"
+
+LOG_MODULE_REGISTER(peer_auth, CONFIG_LORAWAN_LOG_LEVEL);
+
+/*
+ * Uses the CMAC of whichever secure element the LoRaWAN stack is built with,
+ * so no other AES implementation is pulled in.
+ */
+
+static uint8_t peer_key[16];
+static bool key_valid;
+
+static int load_key(void) {
+	if (key_valid) {
+		return 0;
+	}
+
+	if (strlen(CONFIG_LORA_PEER_KEY) != 2 * sizeof(peer_key) ||
+	    hex2bin(CONFIG_LORA_PEER_KEY, strlen(CONFIG_LORA_PEER_KEY),
+		    peer_key, sizeof(peer_key)) != sizeof(peer_key)) {
+		LOG_ERR("CONFIG_LORA_PEER_KEY must be 32 hex digits");
+		return -EINVAL;
+	}
+
+	key_valid = true;
+	return 0;
+}
+
+#ifdef CONFIG_HAS_PSA_STORAGE_SE
+static psa_key_id_t peer_key_id;
+
+int lora_peer_mic(const uint8_t *data, size_t len, uint8_t *mic) {
+	psa_key_attributes_t attributes = PSA_KEY_ATTRIBUTES_INIT;
+	uint8_t cmac[PSA_MAC_LENGTH(PSA_KEY_TYPE_AES, 128, PSA_ALG_CMAC)];
+	psa_status_t status;
+	size_t cmac_len;
+	int ret;
+
+	ret = load_key();
+	if (ret != 0) {
+		return ret;
+	}
+
+	if (peer_key_id == PSA_KEY_ID_NULL) {
+		psa_set_key_usage_flags(&attributes, PSA_KEY_USAGE_SIGN_MESSAGE);
+		psa_set_key_lifetime(&attributes, PSA_KEY_LIFETIME_VOLATILE);
+		psa_set_key_algorithm(&attributes, PSA_ALG_CMAC);
+		psa_set_key_type(&attributes, PSA_KEY_TYPE_AES);
+		psa_set_key_bits(&attributes, 128);
+
+		status = psa_import_key(&attributes, peer_key, sizeof(peer_key), &peer_key_id);
+		psa_reset_key_attributes(&attributes);
+		if (status != PSA_SUCCESS) {
+			LOG_ERR("Failed to import remote key: %d", status);
+			return -EIO;
+		}
+	}
+
+	status = psa_mac_compute(peer_key_id, PSA_ALG_CMAC, data, len, cmac, sizeof(cmac), &cmac_len);
+	if (status != PSA_SUCCESS) {
+		LOG_ERR("Remote frame CMAC failed: %d", status);
+		return -EIO;
+	}
+
+	memcpy(mic, cmac, LORA_PEER_MIC_LEN);
+	return 0;
+}
+#else
+int lora_peer_mic(const uint8_t *data, size_t len, uint8_t *mic) {
+	AES_CMAC_CTX ctx;
+	uint8_t cmac[AES_CMAC_DIGEST_LENGTH];
+	int ret;
+
+	ret = load_key();
+	if (ret != 0) {
+		return ret;
+	}
+
+	AES_CMAC_Init(&ctx);
+	AES_CMAC_SetKey(&ctx, peer_key);
+	AES_CMAC_Update(&ctx, data, len);
+	AES_CMAC_Final(cmac, &ctx);
+
+	memcpy(mic, cmac, LORA_PEER_MIC_LEN);
+	return 0;
+}
+#endif
+
+bool lora_peer_verify(const uint8_t *data, size_t len, const uint8_t *mic) {
+	uint8_t expected[LORA_PEER_MIC_LEN];
+	uint8_t diff = 0;
+
+	if (lora_peer_mic(data, len, expected) != 0) {
+		return false;
+	}
+
+	/* Constant time */
+	for (int i = 0; i < LORA_PEER_MIC_LEN; i++) {
+		diff |= expected[i] ^ mic[i];
+	}
+
+	return diff == 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __LORAWAN_PEER_AUTH_H__
+#define __LORAWAN_PEER_AUTH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compute the truncated MIC of a remote frame with the shared remote key.
+ */
+int lora_peer_mic(const uint8_t *data, size_t len, uint8_t *mic);
+
+/**
+ * Check the MIC that follows `len` bytes of a remote frame.
+ */
+bool lora_peer_verify(const uint8_t *data, size_t len, const uint8_t *mic);
+
+#endif
@@ -1,7 +1,7 @@
 /*!
- * \file      soft-se.c
+ * \file      se.c
  *
- * \brief     Secure Element software implementation
+ * \brief     Secure Element on PSA crypto
  *
  * \copyright Revised BSD License, see section \ref LICENSE.
  *
@@ -26,6 +26,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <psa/crypto.h>
+#include <mbedtls/platform_util.h>
+
+#include <string.h>
+
 #include "utilities.h"
 
 #include "LoRaMacHeaderTypes.h"
@@ -35,6 +43,150 @@
 
 #include "keys.h"
 
+LOG_MODULE_REGISTER(se, CONFIG_LORAWAN_LOG_LEVEL);
+
+/*
+ * The key values stay in the NVM context, which LoRaMac saves and restores
+ * with the session, but every operation runs on a volatile PSA key. A key is
+ * imported on first use and again when its NVM copy changes, e.g. when a
+ * session is restored. PSA keys are bound to one algorithm, so root keys used
+ * for both the MIC and encryption end up imported twice.
+ */
+
+enum se_alg {
+	SE_ALG_ECB,
+	SE_ALG_CMAC,
+	SE_ALG_COUNT,
+};
+
+static const psa_algorithm_t se_algs[SE_ALG_COUNT] = {
+	[SE_ALG_ECB] = PSA_ALG_ECB_NO_PADDING,
+	[SE_ALG_CMAC] = PSA_ALG_CMAC,
+};
+
+static const psa_key_usage_t se_usages[SE_ALG_COUNT] = {
+	[SE_ALG_ECB] = PSA_KEY_USAGE_ENCRYPT,
+	[SE_ALG_CMAC] = PSA_KEY_USAGE_SIGN_MESSAGE,
+};
+
+/* Same order as SOFT_SE_KEY_LIST */
+static const KeyIdentifier_t key_ids[NUM_OF_KEYS] = {
+	APP_KEY, NWK_KEY, J_INT_KEY, J_S_ENC_KEY,
+	F_NWK_S_INT_KEY, S_NWK_S_INT_KEY, NWK_S_ENC_KEY, APP_S_KEY,
+	MC_ROOT_KEY, MC_KE_KEY,
+	MC_KEY_0, MC_APP_S_KEY_0, MC_NWK_S_KEY_0,
+	MC_KEY_1, MC_APP_S_KEY_1, MC_NWK_S_KEY_1,
+	MC_KEY_2, MC_APP_S_KEY_2, MC_NWK_S_KEY_2,
+	MC_KEY_3, MC_APP_S_KEY_3, MC_NWK_S_KEY_3,
+	SLOT_RAND_ZERO_KEY,
+};
+
+struct se_key {
+	psa_key_id_t handle[SE_ALG_COUNT];
+	/* The NVM value the handles were imported from */
+	uint8_t imported[SE_KEY_SIZE];
+};
+
+static SecureElementNvmData_t *se_nvm;
+static struct se_key se_keys[NUM_OF_KEYS];
+
+static int find_key(KeyIdentifier_t keyID) {
+	for (int i = 0; i < NUM_OF_KEYS; i++) {
+		if (se_nvm->KeyList[i].KeyID == keyID) {
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static void drop_key(int i) {
+	for (int alg = 0; alg < SE_ALG_COUNT; alg++) {
+		if (se_keys[i].handle[alg] != PSA_KEY_ID_NULL) {
+			psa_destroy_key(se_keys[i].handle[alg]);
+			se_keys[i].handle[alg] = PSA_KEY_ID_NULL;
+		}
+	}
+	mbedtls_platform_zeroize(se_keys[i].imported, SE_KEY_SIZE);
+}
+
+static SecureElementStatus_t get_key(KeyIdentifier_t keyID, enum se_alg alg, psa_key_id_t *handle) {
+	psa_key_attributes_t attributes = PSA_KEY_ATTRIBUTES_INIT;
+	psa_status_t status;
+	int i;
+
+	if (se_nvm == NULL) {
+		return SECURE_ELEMENT_ERROR;
+	}
+
+	i = find_key(keyID);
+	if (i < 0) {
+		return SECURE_ELEMENT_ERROR_INVALID_KEY_ID;
+	}
+
+	if (memcmp(se_keys[i].imported, se_nvm->KeyList[i].KeyValue, SE_KEY_SIZE) != 0) {
+		drop_key(i);
+		memcpy(se_keys[i].imported, se_nvm->KeyList[i].KeyValue, SE_KEY_SIZE);
+	}
+
+	if (se_keys[i].handle[alg] == PSA_KEY_ID_NULL) {
+		psa_set_key_usage_flags(&attributes, se_usages[alg]);
+		psa_set_key_lifetime(&attributes, PSA_KEY_LIFETIME_VOLATILE);
+		psa_set_key_algorithm(&attributes, se_algs[alg]);
+		psa_set_key_type(&attributes, PSA_KEY_TYPE_AES);
+		psa_set_key_bits(&attributes, SE_KEY_SIZE * 8);
+
+		status = psa_import_key(&attributes, se_nvm->KeyList[i].KeyValue, SE_KEY_SIZE,
+					&se_keys[i].handle[alg]);
+		psa_reset_key_attributes(&attributes);
+		if (status != PSA_SUCCESS) {
+			LOG_ERR("Failed to import key %d: %d", keyID, status);
+			return SECURE_ELEMENT_ERROR;
+		}
+	}
+
+	*handle = se_keys[i].handle[alg];
+	return SECURE_ELEMENT_SUCCESS;
+}
+
+static SecureElementStatus_t compute_cmac(uint8_t *micBxBuffer, uint8_t *buffer, uint16_t size,
+					  KeyIdentifier_t keyID, uint32_t *cmac) {
+	psa_mac_operation_t op = PSA_MAC_OPERATION_INIT;
+	uint8_t mac[PSA_MAC_LENGTH(PSA_KEY_TYPE_AES, 128, PSA_ALG_CMAC)];
+	SecureElementStatus_t ret;
+	psa_key_id_t handle;
+	psa_status_t status;
+	size_t len;
+
+	if (buffer == NULL || cmac == NULL) {
+		return SECURE_ELEMENT_ERROR_NPE;
+	}
+
+	ret = get_key(keyID, SE_ALG_CMAC, &handle);
+	if (ret != SECURE_ELEMENT_SUCCESS) {
+		return ret;
+	}
+
+	status = psa_mac_sign_setup(&op, handle, PSA_ALG_CMAC);
+	if (status == PSA_SUCCESS && micBxBuffer != NULL) {
+		status = psa_mac_update(&op, micBxBuffer, 16);
+	}
+	if (status == PSA_SUCCESS) {
+		status = psa_mac_update(&op, buffer, size);
+	}
+	if (status == PSA_SUCCESS) {
+		status = psa_mac_sign_finish(&op, mac, sizeof(mac), &len);
+	}
+	if (status != PSA_SUCCESS) {
+		psa_mac_abort(&op);
+		LOG_ERR("CMAC with key %d failed: %d", keyID, status);
+		return SECURE_ELEMENT_FAIL_CMAC;
+	}
+
+	*cmac = sys_get_le32(mac);
+	return SECURE_ELEMENT_SUCCESS;
+}
+
 /* Copied unmodified from soft-se.c. This function depends on the other
  * secure element functions and can be abstracted completely from them.
  */
@@ -138,37 +290,156 @@ SecureElementStatus_t SecureElementProcessJoinAccept( JoinReqIdentifier_t joinRe
 }
 
 SecureElementStatus_t SecureElementInit( SecureElementNvmData_t* nvm ) {
-        /* TODO */
-        return SECURE_ELEMENT_ERROR;
+	psa_status_t status;
+
+	if (nvm == NULL) {
+		return SECURE_ELEMENT_ERROR_NPE;
+	}
+
+	status = psa_crypto_init();
+	if (status != PSA_SUCCESS) {
+		LOG_ERR("Failed to initialize PSA crypto: %d", status);
+		return SECURE_ELEMENT_ERROR;
+	}
+
+	for (int i = 0; i < NUM_OF_KEYS; i++) {
+		drop_key(i);
+	}
+
+	/* The EUIs come from keys.c and the root keys are set by eui.c */
+	se_nvm = nvm;
+	memset(se_nvm, 0, sizeof(*se_nvm));
+	for (int i = 0; i < NUM_OF_KEYS; i++) {
+		se_nvm->KeyList[i].KeyID = key_ids[i];
+	}
+
+	return SECURE_ELEMENT_SUCCESS;
 }
 
 SecureElementStatus_t SecureElementDeriveAndStoreKey( uint8_t* input, KeyIdentifier_t rootKeyID,
                                                       KeyIdentifier_t targetKeyID ) {
-        /* TODO */
-        return SECURE_ELEMENT_ERROR;
+	uint8_t key[SE_KEY_SIZE];
+	SecureElementStatus_t ret;
+
+	if (input == NULL) {
+		return SECURE_ELEMENT_ERROR_NPE;
+	}
+
+	/* The multicast key encryption key can only be derived from the multicast root key */
+	if (targetKeyID == MC_KE_KEY && rootKeyID != MC_ROOT_KEY) {
+		return SECURE_ELEMENT_ERROR_INVALID_KEY_ID;
+	}
+
+	ret = SecureElementAesEncrypt(input, SE_KEY_SIZE, rootKeyID, key);
+	if (ret == SECURE_ELEMENT_SUCCESS) {
+		ret = SecureElementSetKey(targetKeyID, key);
+	}
+	mbedtls_platform_zeroize(key, sizeof(key));
+
+	return ret;
 }
 
 SecureElementStatus_t SecureElementAesEncrypt( uint8_t* buffer, uint16_t size, KeyIdentifier_t keyID,
                                                uint8_t* encBuffer ) {
-        /* TODO */
-        return SECURE_ELEMENT_ERROR;
+	SecureElementStatus_t ret;
+	psa_key_id_t handle;
+	psa_status_t status;
+	size_t len;
+
+	if (buffer == NULL || encBuffer == NULL) {
+		return SECURE_ELEMENT_ERROR_NPE;
+	}
+
+	if (size % 16 != 0) {
+		return SECURE_ELEMENT_ERROR_BUF_SIZE;
+	}
+
+	ret = get_key(keyID, SE_ALG_ECB, &handle);
+	if (ret != SECURE_ELEMENT_SUCCESS) {
+		return ret;
+	}
+
+	status = psa_cipher_encrypt(handle, PSA_ALG_ECB_NO_PADDING, buffer, size, encBuffer, size, &len);
+	if (status != PSA_SUCCESS) {
+		LOG_ERR("Encrypt with key %d failed: %d", keyID, status);
+		return SECURE_ELEMENT_FAIL_ENCRYPT;
+	}
+
+	return SECURE_ELEMENT_SUCCESS;
 }
 
 SecureElementStatus_t SecureElementComputeAesCmac( uint8_t* micBxBuffer, uint8_t* buffer, uint16_t size,
                                                    KeyIdentifier_t keyID, uint32_t* cmac ) {
-        /* TODO */
-        return SECURE_ELEMENT_ERROR;
+	/* Multicast keys are never used for a MIC */
+	if (keyID >= LORAMAC_CRYPTO_MULTICAST_KEYS) {
+		return SECURE_ELEMENT_ERROR_INVALID_KEY_ID;
+	}
+
+	return compute_cmac(micBxBuffer, buffer, size, keyID, cmac);
 }
 
 SecureElementStatus_t SecureElementVerifyAesCmac( uint8_t* buffer, uint16_t size, uint32_t expectedCmac,
                                                   KeyIdentifier_t keyID ) {
-        /* TODO */
-        return SECURE_ELEMENT_ERROR;
+	SecureElementStatus_t ret;
+	uint32_t cmac = 0;
+
+	if (buffer == NULL) {
+		return SECURE_ELEMENT_ERROR_NPE;
+	}
+
+	ret = compute_cmac(NULL, buffer, size, keyID, &cmac);
+	if (ret == SECURE_ELEMENT_SUCCESS && cmac != expectedCmac) {
+		ret = SECURE_ELEMENT_FAIL_CMAC;
+	}
+
+	return ret;
 }
 
 SecureElementStatus_t SecureElementSetKey( KeyIdentifier_t keyID, uint8_t* key ) {
-        /* TODO */
-        return SECURE_ELEMENT_ERROR;
+	SecureElementStatus_t ret = SECURE_ELEMENT_SUCCESS;
+	uint8_t dec_key[SE_KEY_SIZE];
+	int i;
+
+	if (key == NULL) {
+		return SECURE_ELEMENT_ERROR_NPE;
+	}
+
+	if (se_nvm == NULL) {
+		return SECURE_ELEMENT_ERROR;
+	}
+
+	i = find_key(keyID);
+	if (i < 0) {
+		return SECURE_ELEMENT_ERROR_INVALID_KEY_ID;
+	}
+
+	/* Multicast keys arrive encrypted with the multicast key encryption key */
+	if (keyID == MC_KEY_0 || keyID == MC_KEY_1 || keyID == MC_KEY_2 || keyID == MC_KEY_3) {
+		ret = SecureElementAesEncrypt(key, SE_KEY_SIZE, MC_KE_KEY, dec_key);
+		key = dec_key;
+	}
+
+	if (ret == SECURE_ELEMENT_SUCCESS) {
+		/* Re-imported on next use */
+		drop_key(i);
+		memcpy(se_nvm->KeyList[i].KeyValue, key, SE_KEY_SIZE);
+	}
+	mbedtls_platform_zeroize(dec_key, sizeof(dec_key));
+
+	return ret;
+}
+
+SecureElementStatus_t SecureElementRandomNumber( uint32_t* randomNum )
+{
+	if (randomNum == NULL) {
+		return SECURE_ELEMENT_ERROR_NPE;
+	}
+
+	if (psa_generate_random((uint8_t *)randomNum, sizeof(*randomNum)) != PSA_SUCCESS) {
+		return SECURE_ELEMENT_ERROR;
+	}
+
+	return SECURE_ELEMENT_SUCCESS;
 }
 
 SecureElementStatus_t SecureElementSetDevEui( uint8_t* devEui )
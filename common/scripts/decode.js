@@ -7,27 +7,60 @@ function decodeUplink(input) {
                 case 0x00:
                         ret.data = decodeKitData(input.bytes)
                         break
+                /* A second device of the same kind reports 8 ports up */
                 case 0x10:
+                case 0x18:
                         ret.data = decodeRenogySystemConfig(input.bytes)
                         break
                 case 0x11:
+                case 0x19:
                         ret.data = decodeRenogyBatteryConfig(input.bytes)
                         break
                 case 0x12:
+                case 0x1A:
                         ret.data = decodeRenogyChargingState(input.bytes)
                         break
                 case 0x13:
+                case 0x1B:
                         ret.data = decodeRenogyStatus(input.bytes)
                         break
+                case 0x15:
+                        ret.data = decodeChargerSeries(input.bytes)
+                        break
+                case 0x16:
+                case 0x1E:
+                        ret.data = decodeChargerDelta(input.bytes)
+                        break
+                case 0x17:
+                case 0x1F:
+                        ret.data = decodeChargerQuery(input.bytes)
+                        break
+                case 0x14:
+                case 0x1C:
+                        ret.data = decodeRenogyBms(input.bytes)
+                        break
                 case 0x20:
                         ret.data = decodeBootStatus(input.bytes)
                         break;
+                case 0x30:
+                        ret.data = decodeMulti(input.bytes)
+                        break;
                 case 0x80:
                 case 0x81:
                 case 0x82:
                         /* Outputs */
                         ret.data = { state: input.bytes[0] }
                         break;
+                case 0x88:
+                        ret.data = decodeEntranceStatus(input.bytes)
+                        break;
+                case 0x89:
+                        ret.data = decodePeerEvent(input.bytes)
+                        break;
+                case 0x90:
+                case 0x91:
+                        ret.data = decodeSchedConfirm(input.bytes)
+                        break;
                 case 200:
                         ret.data = decodeMCastResponse(input.bytes)
                         break;
@@ -61,10 +94,16 @@ function getString(index, len, bytes) {
         return String.fromCharCode(...bytes.slice(index, index + len))
 }
 
+function getS8(index, bytes) {
+        return (bytes[index] << 24) >> 24
+}
+
 function getVersion(index, bytes) {
-        var major = bytes[index]
-        var minor = bytes[index]
-        var fix = bytes[index]
+        // Encoded as 0x00MMmmpp
+        var version = getU32(index, bytes)
+        var major = (version >> 16) & 0xFF
+        var minor = (version >> 8) & 0xFF
+        var fix = version & 0xFF
         return major + "." + minor + "." + fix
 }
 
@@ -75,6 +114,70 @@ function decodeBootStatus(bytes) {
         }
 }
 
+function decodeEntranceStatus(bytes) {
+        // lorawan_entr_status_uplink_t
+        var ret = {
+                seq: bytes[0],
+                entrances: [],
+        }
+        var base_port = bytes[1]
+        var count = bytes[2]
+
+        for (var i = 0; i < count; i++) {
+                var idx = 3 + 4 * i
+                ret.entrances.push({
+                        port: base_port + i,
+                        state: bytes[idx] & 0x0F,
+                        next_state: bytes[idx] >> 4,
+                        eta_s: bytes[idx + 1],
+                        pending_cmd: bytes[idx + 2] & 0x0F,
+                        cmd_result: bytes[idx + 2] >> 4,
+                        cmd_seq: bytes[idx + 3],
+                })
+        }
+
+        return ret
+}
+
+function decodePeerEvent(bytes) {
+        // lorawan_peer_event_uplink_t
+        return {
+                counter: getU32(0, bytes) >>> 0,
+                btn: bytes[4],
+                action: bytes[5],
+                cmd_result: bytes[6],
+        }
+}
+
+function decodeMulti(bytes) {
+        // lorawan_multi_record_hdr_t followed by the record, repeated
+        var records = []
+        var i = 0
+        while (i + 2 <= bytes.length) {
+                var port = bytes[i]
+                var len = bytes[i + 1]
+                var rec = bytes.slice(i + 2, i + 2 + len)
+                if (rec.length != len) {
+                        break
+                }
+                records.push({
+                        port: port,
+                        data: decodeUplink({ fPort: port, bytes: rec }).data,
+                })
+                i += 2 + len
+        }
+        return records
+}
+
+function decodeSchedConfirm(bytes) {
+        // lorawan_entr_sched_uplink_t
+        return {
+                slot: bytes[0] == 0xFF ? "hold" : bytes[0],
+                status: (bytes[1] << 24) >> 24,
+                next_start_s: getU32(2, bytes) >>> 0,
+        }
+}
+
 function decodeMCastResponse(bytes) {
         /* Response type is first byte */
         switch (bytes[0]) {
@@ -143,7 +246,7 @@ function decodeFragResponse(bytes) {
 }
 
 function decodeRenogySystemConfig(bytes) {
-        // renogy_sys_t
+        // REN_SYS_FIELDS
         return {
                 max_charge_current: bytes[0],
                 max_supported_voltage: bytes[1],
@@ -152,13 +255,13 @@ function decodeRenogySystemConfig(bytes) {
                 model: getString(4, 16, bytes),
                 software_version: getVersion(20, bytes),
                 hardware_version: getVersion(24, bytes),
-                serial: getU32(28, bytes),
+                serial: getU32(28, bytes) >>> 0,
                 device_address: getU16(32, bytes),
         }
 }
 
 function decodeRenogyBatteryConfig(bytes) {
-        // renogy_param_bat_t
+        // REN_BAT_FIELDS
         var ret = {
                 detected_battery_V: bytes[0],
                 configured_battery_V: bytes[1],
@@ -215,13 +318,17 @@ function decodeRenogyBatteryConfig(bytes) {
 }
 
 function decodeRenogyChargingState(bytes) {
-        // renogy_dyn_status_t
+        // REN_STATUS_FIELDS
         var ret = {
                 charge_state: bytes[0],
                 load_on: (bytes[1] & 0x80) != 0,
                 load_dim: (bytes[1] & 0x7F),
         }
 
+        if (bytes.length >= 6) {
+                ret.faults = getU32(2, bytes) >>> 0
+        }
+
         /* Charge state */
         switch (bytes[0]) {
                 case 0:
@@ -253,13 +360,13 @@ function decodeRenogyChargingState(bytes) {
 }
 
 function decodeRenogyStatus(bytes) {
-        // renogy_dyn_statistics_t
+        // REN_STATS_FIELDS
         return {
                 soc_pct: getU16(0, bytes),
                 battery_V: getU16(2, bytes) / 10.0,
                 charge_A: getU16(4, bytes) / 100.0,
-                controller_temp_C: bytes[7],
-                battery_temp_C: bytes[6],
+                controller_temp_C: getS8(7, bytes),
+                battery_temp_C: getS8(6, bytes),
                 load_voltage_V: getU16(8, bytes) / 10.0,
                 load_current_A: getU16(10, bytes) / 100.0,
                 load_power_W: getU16(12, bytes),
@@ -269,6 +376,165 @@ function decodeRenogyStatus(bytes) {
         }
 }
 
+function decodeRenogyDaily(bytes) {
+        // REN_DAILY_FIELDS
+        return {
+                min_battery_V: getU16(0, bytes) / 10.0,
+                max_battery_V: getU16(2, bytes) / 10.0,
+                max_charge_A: getU16(4, bytes) / 100.0,
+                max_discharge_A: getU16(6, bytes) / 100.0,
+                max_charge_W: getU16(8, bytes),
+                max_discharge_W: getU16(10, bytes),
+                charge_Ah: getU16(12, bytes),
+                discharge_Ah: getU16(14, bytes),
+                generation_kWh: getU16(16, bytes) / 10000.0,
+                consumption_kWh: getU16(18, bytes) / 10000.0,
+        }
+}
+
+function decodeRenogyHist(bytes) {
+        // REN_HIST_FIELDS
+        return {
+                operating_days: getU16(0, bytes),
+                over_discharge_count: getU16(2, bytes),
+                full_charge_count: getU16(4, bytes),
+                charge_Ah: getU32(6, bytes) >>> 0,
+                discharge_Ah: getU32(10, bytes) >>> 0,
+                generation_kWh: (getU32(14, bytes) >>> 0) / 10000.0,
+                consumption_kWh: (getU32(18, bytes) >>> 0) / 10000.0,
+        }
+}
+
+function decodeChargerQuery(bytes) {
+        // lorawan_charger_query_uplink_hdr_t, groups in bit order
+        var groups = [
+                ["system", 34, decodeRenogySystemConfig],
+                ["battery", 36, decodeRenogyBatteryConfig],
+                ["state", 6, decodeRenogyChargingState],
+                ["stats", 20, decodeRenogyStatus],
+                ["daily", 20, decodeRenogyDaily],
+                ["history", 22, decodeRenogyHist],
+        ]
+        var present = bytes[0]
+        var idx = 1
+        var ret = {}
+
+        for (var i = 0; i < groups.length; i++) {
+                if (!(present & (1 << i))) {
+                        continue
+                }
+                ret[groups[i][0]] = groups[i][2](bytes.slice(idx, idx + groups[i][1]))
+                idx += groups[i][1]
+        }
+
+        return ret
+}
+
+function decodeRenogyBms(bytes) {
+        // REN_BMS_FIELDS
+        return {
+                current_A: ((getU16(0, bytes) << 16) >> 16) / 100.0,
+                voltage_V: getU16(2, bytes) / 10.0,
+                remaining_Ah: (getU32(4, bytes) >>> 0) / 1000.0,
+                capacity_Ah: (getU32(8, bytes) >>> 0) / 1000.0,
+                cycles: getU16(12, bytes),
+        }
+}
+
+function decodeChargerSeries(bytes) {
+        // LORAWAN_PORT_CHARGER_SERIES, channels in lorawan_series_channel_t order
+        var channels = [
+                { name: "battery_V", scale: 10.0 },
+                { name: "charge_A", scale: 100.0 },
+                { name: "load_power_W", scale: 1.0 },
+                { name: "solar_power_W", scale: 1.0 },
+        ]
+        var count = bytes[0]
+        var idx = 3
+        var mean = []
+        var ret = {
+                window_s: getU16(1, bytes),
+                windows: [],
+        }
+
+        function varint() {
+                var val = 0
+                var shift = 0
+                var b
+                do {
+                        b = bytes[idx++]
+                        val |= (b & 0x7F) << shift
+                        shift += 7
+                } while (b & 0x80)
+                return val >>> 0
+        }
+
+        for (var w = 0; w < count; w++) {
+                var win = {}
+                for (var c = 0; c < channels.length; c++) {
+                        if (w == 0) {
+                                mean[c] = getU16(idx, bytes)
+                                idx += 2
+                        } else {
+                                var zz = varint()
+                                mean[c] += (zz >>> 1) ^ -(zz & 1)
+                        }
+                        var low = varint()
+                        var high = varint()
+                        win[channels[c].name] = {
+                                min: (mean[c] - low) / channels[c].scale,
+                                mean: mean[c] / channels[c].scale,
+                                max: (mean[c] + high) / channels[c].scale,
+                        }
+                }
+                ret.windows.push(win)
+        }
+
+        return ret
+}
+
+function decodeChargerDelta(bytes) {
+        // LORAWAN_PORT_CHARGER_DELTA, fields in DELTA_FIELDS order
+        var fields = [
+                ["soc_pct", 1],
+                ["battery_V", 10.0],
+                ["charge_A", 100.0],
+                ["battery_temp_C", 1],
+                ["controller_temp_C", 1],
+                ["load_voltage_V", 10.0],
+                ["load_current_A", 100.0],
+                ["load_power_W", 1],
+                ["solar_voltage_V", 10.0],
+                ["solar_current_A", 100.0],
+                ["solar_power_W", 1],
+                ["charge_state_n", 1],
+                ["load_status", 1],
+                ["faults", 1],
+        ]
+        var present = getU16(0, bytes)
+        var idx = 2
+        var ret = {}
+
+        for (var i = 0; i < fields.length; i++) {
+                if (!(present & (1 << i))) {
+                        continue
+                }
+                // Zigzag varint of up to 35 bits, beyond JS bitwise operators
+                var zz = 0
+                var mul = 1
+                var b
+                do {
+                        b = bytes[idx++]
+                        zz += (b & 0x7F) * mul
+                        mul *= 128
+                } while (b & 0x80)
+                var val = (zz % 2) ? -(zz + 1) / 2 : zz / 2
+                ret[fields[i][0]] = val / fields[i][1]
+        }
+
+        return ret
+}
+
 function decodeKitData(bytes) {
         // init
         var bytesString = bytes2HexString(bytes)
@@ -3,26 +3,65 @@
 import base64
 import json
 import logging
+import random
 import struct
-from typing import Any
+import time
+from typing import Any, Iterator, NamedTuple, Optional
 
-from remote_const import GateState, GateCmd, PortId
+from remote_const import CmdResult, GateState, GateCmd, PortId
 
 import paho.mqtt.client as mqtt
 
 logger = logging.getLogger(__name__)
 
 
+class EntranceStatus(NamedTuple):
+    """State of one entrance, and the outcome of its last command."""
+
+    port: PortId
+    state: GateState
+    cmd_seq: int = 0
+    cmd_result: CmdResult = CmdResult.NONE
+
+
+def entrance_states(port: int, obj: dict) -> Iterator[EntranceStatus]:
+    """Fan a decoded state uplink back out to per-entrance states.
+
+    Aggregated status uplinks carry every entrance on a controller, keyed by
+    the relay port that the entrance accepts commands on. Per-relay state
+    uplinks from older firmware carry a single state.
+    """
+    if port != PortId.ENTR_STATUS.value:
+        yield EntranceStatus(PortId(port), GateState(obj.get("state")))
+        return
+
+    for entr in obj.get("entrances", []):
+        try:
+            yield EntranceStatus(
+                PortId(entr["port"]),
+                GateState(entr["state"]),
+                entr.get("cmd_seq", 0),
+                CmdResult(entr.get("cmd_result", 0)),
+            )
+        except ValueError:
+            logger.warning("Ignoring unknown entrance %s", entr)
+
+
 class GateStateMachine:
     """Translates gate controller state messages to messages HA understands.
 
     See https://www.home-assistant.io/integrations/cover.mqtt/
     """
 
+    # How long a command without a reported outcome is repeated under the
+    # same sequence number. Must be below the controller's CMD_DEDUP_WINDOW_MS.
+    PENDING_REUSE_S = 30
+
     HA_OPEN = "open"
     HA_OPENING = "opening"
     HA_CLOSED = "closed"
     HA_CLOSING = "closing"
+    HA_STOPPED = "stopped"
 
     GATE_UID = {
         PortId.GATE_STATE: "driveway_gate",
@@ -35,6 +74,13 @@ class GateStateMachine:
         PortId.GARAGE2_STATE: "garage",
     }
 
+    # Index of the entrance on its controller, for the schedule downlinks
+    ENTRANCE_INDEX = {
+        PortId.GATE_STATE: 0,
+        PortId.GARAGE1_STATE: 0,
+        PortId.GARAGE2_STATE: 1,
+    }
+
     def __init__(
         self,
         client: mqtt.Client,
@@ -47,11 +93,20 @@ class GateStateMachine:
         self.port = port
         self.state = state
         self.uid = self.GATE_UID[self.port]
+        self.entrance = self.ENTRANCE_INDEX[self.port]
+        # Sequence number of the last command sent, and the command while
+        # its outcome hasn't been reported yet. The number starts anywhere
+        # and follows the controller's reports, so a restart of this service
+        # doesn't repeat the number the controller saw last.
+        self.seq = random.randint(1, 255)
+        self.pending: Optional[GateCmd] = None
+        self.pending_at = 0.0
         # The controller topic
         self.ctrl_topic = topic
         self.eui = eui
         logger.debug("Subscribing to %s", self.cmd_topic)
         client.message_callback_add(self.cmd_topic, self._cmd_callback)
+        client.message_callback_add(self.schedule_topic, self._schedule_callback)
         self._announce()
 
     @property
@@ -63,6 +118,11 @@ class GateStateMachine:
     def cmd_topic(self):
         return self.topic + "/command"
 
+    @property
+    def schedule_topic(self):
+        """Hold open schedules, not part of the HA cover integration"""
+        return self.topic + "/schedule"
+
     @property
     def config_topic(self):
         return self.topic + "/config"
@@ -114,13 +174,41 @@ class GateStateMachine:
         # serviced by chirpstack. Downlink frames are sent immediately in
         # a Class C context. Class C is initiated by the device by sending
         # a MAC command.
-        logger.info("Sending cmd %s to %s port %s", cmd, self.eui, self.port)
-        rsp = struct.Struct("B")
-        payload = rsp.pack(cmd.value)
+        now = time.monotonic()
+        if cmd != self.pending or now - self.pending_at > self.PENDING_REUSE_S:
+            # Repeating an outstanding command shortly after reuses its
+            # sequence number, so the controller only applies it once. Later
+            # it is a new request, even if the outcome report was lost.
+            self.seq = self.seq % 255 + 1
+            self.pending = cmd
+            self.pending_at = now
+        logger.info("Sending cmd %s seq %d to %s port %s", cmd, self.seq, self.eui, self.port)
+        rsp = struct.Struct("BB")
+        self._downlink(self.port, rsp.pack(cmd.value, self.seq))
+
+    def schedule_hold(self, start: int, duration_s: int):
+        """Hold the entrance open once, from a unix time. A time in the past cancels the hold."""
+        logger.info("Scheduling hold on %s at %d for %ds", self.uid, start, duration_s)
+        rsp = struct.Struct("<QIB")
+        self._downlink(PortId.GATE_SCHED, rsp.pack(start, duration_s, self.entrance))
+
+    def schedule_rule(self, slot: int, days: int, start_min: int, duration_min: int):
+        """Store a daily hold open rule, starting in minutes after midnight UTC.
+
+        `days` is a bitmask with bit 0 for Sunday, 0 deletes the rule.
+        """
+        if not 0 <= start_min < 24 * 60 or not 0 <= duration_min <= 24 * 60:
+            raise ValueError("Rule start and duration must be within a day")
+        logger.info("Setting rule %d on %s: days 0x%02x at %d for %d min",
+                    slot, self.uid, days, start_min, duration_min)
+        rsp = struct.Struct("<BBBHH")
+        self._downlink(PortId.GATE_RULES, rsp.pack(slot, self.entrance, days, start_min, duration_min))
+
+    def _downlink(self, port: PortId, payload: bytes):
         msg = {
             "devEui": self.eui,
             "confirmed": False,
-            "fPort": self.port.value,
+            "fPort": port.value,
             "data": base64.b64encode(payload).decode(),
         }
         logger.debug(msg)
@@ -139,12 +227,52 @@ class GateStateMachine:
             if self.state == GateState.MOM_OPEN:
                 # Stop during momentary open should be interpreted as hold open
                 self.command(GateCmd.HOLD_OPEN)
-            # TODO: we don't currently do anything to stop a partially opened or closed cover.
+            elif self.state == GateState.MOVING:
+                # Ignored by controllers whose opener can't be stopped
+                self.command(GateCmd.STOP)
         else:
             logger.warning("Unknown command payload %s", msg.payload)
 
-    def update(self, state: GateState):
+    # pylint: disable=unused-argument
+    def _schedule_callback(self, client: mqtt.Client, userdata: Any, msg: mqtt.MQTTMessage):
+        """Handle a schedule published as JSON, one of
+
+        {"hold": {"start": <unix time>, "duration_s": <s>}}
+        {"rule": {"slot": <n>, "days": <mask>, "start_min": <min>, "duration_min": <min>}}
+        """
+        logger.debug("Got schedule callback at %s: %s", msg.topic, msg.payload)
+        try:
+            req = json.loads(msg.payload)
+            if "hold" in req:
+                hold = req["hold"]
+                self.schedule_hold(int(hold["start"]), int(hold["duration_s"]))
+            elif "rule" in req:
+                rule = req["rule"]
+                self.schedule_rule(
+                    int(rule["slot"]),
+                    int(rule["days"]),
+                    int(rule["start_min"]),
+                    int(rule["duration_min"]),
+                )
+            else:
+                logger.warning("Unknown schedule payload %s", msg.payload)
+        except (ValueError, KeyError, TypeError, struct.error) as e:
+            logger.warning("Invalid schedule payload %s: %s", msg.payload, e)
+
+    def update(self, state: GateState, cmd_seq: int = 0, cmd_result: CmdResult = CmdResult.NONE):
         """Update gate state and publish message to HomeAssistant."""
+        if self.pending is not None and cmd_seq == self.seq:
+            if cmd_result == CmdResult.IGNORED:
+                logger.warning("%s ignored %s in state %s", self.uid, self.pending, state)
+            else:
+                logger.info("%s: %s %s", self.uid, self.pending, cmd_result.name.lower())
+            # A queued command is reported again once it runs
+            if cmd_result != CmdResult.QUEUED:
+                self.pending = None
+        elif self.pending is None and cmd_seq != 0:
+            # Continue from the controller's last number, e.g. after a restart
+            self.seq = cmd_seq
+
         if state == GateState.MOVING:
             if self.state == GateState.CLOSED:
                 self._publish_state(self.HA_OPENING)
@@ -154,5 +282,9 @@ class GateStateMachine:
             self._publish_state(self.HA_OPEN)
         elif state == GateState.CLOSED:
             self._publish_state(self.HA_CLOSED)
+        elif state in (GateState.UNKNOWN, GateState.STOPPED):
+            # The position sensors could not confirm the position, e.g. the
+            # entrance stalled partway.
+            self._publish_state(self.HA_STOPPED)
 
         self.state = state
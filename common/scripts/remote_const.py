@@ -9,6 +9,8 @@ class GateCmd(enum.Enum):
     CLOSE = 2
     MOM_OPEN = 3
     HOLD_OPEN = 4
+    STOP = 5
+    REVERSE = 6
 
 
 class GateState(enum.Enum):
@@ -17,10 +19,25 @@ class GateState(enum.Enum):
     See app_protocol.h
     """
 
+    UNKNOWN = 0
     CLOSED = 1
     MOVING = 2
     MOM_OPEN = 3
     HOLD_OPEN = 4
+    STOPPED = 5
+
+
+class CmdResult(enum.Enum):
+    """Outcome of the last entrance command.
+
+    See app_protocol.h
+    """
+
+    NONE = 0
+    APPLIED = 1
+    QUEUED = 2
+    IGNORED = 3
+    DUPLICATE = 4
 
 
 class PortId(enum.Enum):
@@ -30,6 +47,13 @@ class PortId(enum.Enum):
     GATE_STATE = 128
     GARAGE1_STATE = 129
     GARAGE2_STATE = 130
+    # Aggregated state of all entrances on a controller
+    ENTR_STATUS = 136
+    # A controller acted on an authenticated remote frame directly
+    PEER_EVENT = 137
+    # One-shot hold open and recurring daily hold open rules
+    GATE_SCHED = 144
+    GATE_RULES = 145
 
 COMMANDS = {
     # Gate
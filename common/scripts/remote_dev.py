@@ -3,6 +3,7 @@
 import json
 import logging
 import struct
+import threading
 
 import paho.mqtt.client as mqtt
 
@@ -19,11 +20,20 @@ class RemoteDevice:
         self,
         client: mqtt.Client,
         btn_count: int,
+        peer_actions: dict[int, set[int]] | None = None,
+        peer_grace_s: float = 3.0,
     ):
         self.client = client
         self.uid = "lora_remote"
         self.sn = "lora_remote_todo"
         self.btn_count = btn_count
+        # Presses that controllers may already have handled peer-to-peer,
+        # keyed by button. Publishing these is held back for a grace period
+        # so HA doesn't send the same command a second time.
+        self.peer_actions = peer_actions or {}
+        self.peer_grace_s = peer_grace_s
+        self._pending: dict[int, threading.Timer] = {}
+        self._lock = threading.Lock()
         self._announce()
 
     @property
@@ -49,6 +59,16 @@ class RemoteDevice:
             logger.info("Battery %f V button %d action %d", battery / 1000, btn, action)
             # Publish to HA
             rsp = self._publish_state(btn, action)
+        elif payload[1] == 0x02:
+            # Authenticated remote command, possibly also seen by a controller
+            s = struct.Struct("<HBBI")
+            (battery, btn, action, counter) = s.unpack_from(payload, 2)
+            logger.info("Battery %f V button %d action %d counter %d",
+                        battery / 1000, btn, action, counter)
+            if action in self.peer_actions.get(btn, ()):
+                rsp = self._defer_state(btn, action, counter)
+            else:
+                rsp = self._publish_state(btn, action)
 
         ack_msg = struct.Struct("BBB")
         ack_payload = ack_msg.pack(0xE0, 0x00, rsp)
@@ -74,6 +94,32 @@ class RemoteDevice:
         # ACK
         return 1
 
+    def on_peer_event(self, counter: int):
+        """A controller handled the press with this counter on its own."""
+        with self._lock:
+            timer = self._pending.pop(counter, None)
+        if timer is not None:
+            timer.cancel()
+            logger.info("Press %d handled by controller", counter)
+
+    def _defer_state(self, btn: int, action: int, counter: int) -> int:
+        """Publish the state unless a controller reports it acted first."""
+        with self._lock:
+            if counter in self._pending:
+                # Retransmission of a press already waiting
+                return 1
+
+            def publish():
+                with self._lock:
+                    if self._pending.pop(counter, None) is None:
+                        return
+                self._publish_state(btn, action)
+
+            timer = threading.Timer(self.peer_grace_s, publish)
+            self._pending[counter] = timer
+            timer.start()
+        return 1
+
     def _announce(self):
         for btn in range(0, self.btn_count):
             for action_len in range(1,3):
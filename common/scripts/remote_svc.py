@@ -35,7 +35,7 @@ import random
 from typing import Any
 
 from remote_const import GateState, COMMANDS, PortId
-from gate_ctrl import GateStateMachine
+from gate_ctrl import GateStateMachine, entrance_states
 from remote_dev import RemoteDevice
 
 from paho.mqtt.reasoncodes import ReasonCode
@@ -58,18 +58,22 @@ remote: RemoteDevice = None
 def on_application_uplink(client: mqtt.Client, path: list[str], obj: Any):
     """Register topics and EUI based on LoRa uplink port."""
     port = obj.get("fPort", 0)
-    if port != 0:
+    if port == PortId.PEER_EVENT.value:
+        event = obj.get("object", {})
+        if remote is not None and "counter" in event:
+            remote.on_peer_event(int(event["counter"]))
+    elif port != 0:
         topic = "/".join(path[:-2])
         eui = obj["deviceInfo"]["devEui"]
 
         try:
-            port_id = PortId(port)
-            state = GateState(obj.get("object").get("state"))
-            if port_id not in gate_sm:
-                logger.info("Registering port %d to %s", port, eui)
-                gate_sm[port_id] = GateStateMachine(client, port_id, topic, eui, state)
-            # Update state and possibly publish to HA
-            gate_sm[port_id].update(state)
+            for status in entrance_states(port, obj.get("object")):
+                port_id = status.port
+                if port_id not in gate_sm:
+                    logger.info("Registering port %d to %s", port_id.value, eui)
+                    gate_sm[port_id] = GateStateMachine(client, port_id, topic, eui, status.state)
+                # Update state and possibly publish to HA
+                gate_sm[port_id].update(status.state, status.cmd_seq, status.cmd_result)
         except ValueError:
             # ValueError due to invalid port ID can be ignored, we just don't
             # do anything with messages we don't do anything for.
@@ -181,6 +185,7 @@ def on_connect(
     client.subscribe("us915_0/gateway/#")
     client.subscribe("application/#")
     client.subscribe("homeassistant/cover/+/command")
+    client.subscribe("homeassistant/cover/+/schedule")
     # client.subscribe("us915_0/gateway/#")
 
 
@@ -206,6 +211,23 @@ def main():
     parser.add_argument(
         "-v", "--verbose", action="store_true", help="Enable verbose logging"
     )
+    parser.add_argument(
+        "-g",
+        "--peer-grace",
+        type=float,
+        default=3.0,
+        help="Seconds to wait for a controller to act on a press before publishing it",
+    )
+    parser.add_argument(
+        "-b",
+        "--peer-button",
+        type=int,
+        action="append",
+        default=[],
+        choices=sorted(COMMANDS),
+        help="Remote button whose presses a controller acts on directly "
+        "(CONFIG_ENTRANCE_PEER), may be repeated",
+    )
 
     args = parser.parse_args()
 
@@ -217,7 +239,10 @@ def main():
     # Remote devices are created statically at startup.
     # pylint: disable=global-statement
     global remote
-    remote = RemoteDevice(mqttc, 3)
+    # Presses that controllers act on directly are only published when no
+    # controller reports having handled them. Other presses aren't held back.
+    peer_actions = {btn: set(COMMANDS[btn][1]) for btn in args.peer_button}
+    remote = RemoteDevice(mqttc, 3, peer_actions, args.peer_grace)
 
     # Blocking call that processes network traffic, dispatches callbacks and
     # handles reconnecting.
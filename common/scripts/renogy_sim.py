@@ -0,0 +1,354 @@
+#!/usr/bin/env python3
+"""Simulated Renogy Rover chargers and smart battery BMSes on a Modbus RTU bus.
+
+Serves the register map in lora_gate/src/renogy_internal.h over a serial
+port or pseudo terminal, so the poller in renogy.c can be run and timed
+without the hardware, e.g. by the renogy_bench app on native_sim:
+
+    $ west build -b native_sim renogy_bench
+    $ ./build/zephyr/zephyr.exe
+    uart_1 connected to pseudotty: /dev/pts/5
+    $ common/scripts/renogy_sim.py --port /dev/pts/5 --charger 1 --bms 48
+
+Without --port a new pseudo terminal is opened and its name printed.
+
+Faults are injected per response: --latency delays it, --crc-error corrupts
+its CRC, --timeout drops it and --busy answers with a device busy exception.
+Responses are paced at the character time of --baud, so bus timing is close
+to an RS-485 bus at that rate.
+
+Writing SIM_FAULT_REG of a device switches it to a scripted fault, which the
+renogy_bench checks use: FAULT_ALTERNATE drops every other request, starting
+with the next, and FAULT_OUTAGE drops all of them. The write itself is always
+answered.
+"""
+
+import argparse
+import logging
+import math
+import os
+import random
+import struct
+import sys
+import time
+import tty
+
+logger = logging.getLogger("renogy_sim")
+
+FC_READ_HOLDING = 0x03
+FC_WRITE_SINGLE = 0x06
+EX_ILLEGAL_FUNCTION = 0x01
+EX_ILLEGAL_ADDRESS = 0x02
+EX_DEVICE_BUSY = 0x06
+
+# Start bit, 8 data bits, stop bit
+BITS_PER_CHAR = 10
+
+# Simulator only register, see renogy_bench/src/main.c
+SIM_FAULT_REG = 0xFF00
+FAULT_NONE = 0
+FAULT_ALTERNATE = 1
+FAULT_OUTAGE = 2
+
+# Battery parameters at 0xE002 as dumped from a charger, see the comments
+# above REN_BAT_FIELDS. The dumps are the register bytes low byte first.
+BATTERY_DUMPS = {
+    "lithium": "0c0c c800 a000 0400"
+               " 8e00 9b00 8e00 8e00 7d00 8400 6e00 7800"
+               " 3264"
+               " 6c00 7800 0500 1e00 7800",
+    "sealed": "0cff c800 a000 0200"
+              " 9200 9b00 8a00 9200 7e00 8400 6f00 7800"
+              " 3264"
+              " 6a00 0000 0500 0000 7800",
+    "gel": "0cff c800 a000 0300"
+           " 9800 9b00 8a00 8e00 7e00 8400 6f00 7800"
+           " 3264"
+           " 6a00 0000 0500 0000 7800",
+    "flooded": "0cff c800 a000 0100"
+               " 9400 9b00 8a00 9200 7e00 8400 6f00 7800"
+               " 3264"
+               " 6a00 7800 0500 1e00 7800",
+}
+
+
+def crc16(data: bytes) -> int:
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return crc
+
+
+def frame(body: bytes) -> bytes:
+    return body + struct.pack("<H", crc16(body))
+
+
+def dump_regs(dump: str) -> list[int]:
+    return [int(w[2:4] + w[0:2], 16) for w in dump.split()]
+
+
+def u32(val: int) -> list[int]:
+    return [(val >> 16) & 0xFFFF, val & 0xFFFF]
+
+
+def temp(val: int) -> int:
+    """Sign and magnitude temperature byte, see ren_temp()."""
+    return (0x80 | min(-val, 0x7F)) if val < 0 else min(val, 0x7F)
+
+
+class Device:
+    """Register map of one device, regenerated from the model on each read."""
+
+    kind = "device"
+
+    def __init__(self, addr: int, day_s: float):
+        self.addr = addr
+        self.day_s = day_s
+        self.start = time.monotonic()
+        self.fault = FAULT_NONE
+        self.dropped = False
+
+    def drop(self) -> bool:
+        """Whether the scripted fault drops this request."""
+        if self.fault == FAULT_ALTERNATE:
+            self.dropped = not self.dropped
+            return self.dropped
+        return self.fault == FAULT_OUTAGE
+
+    def daylight(self) -> float:
+        """Solar output from 0 to 1, starting at sunrise."""
+        phase = ((time.monotonic() - self.start) % self.day_s) / self.day_s
+        return max(0.0, math.sin(2 * math.pi * phase))
+
+    def regs(self) -> dict[int, int]:
+        raise NotImplementedError
+
+    def read(self, start: int, count: int) -> list[int] | None:
+        regs = self.regs()
+        if any(r not in regs for r in range(start, start + count)):
+            return None
+        return [regs[r] for r in range(start, start + count)]
+
+
+class Charger(Device):
+    """Renogy Rover MPPT charge controller."""
+
+    kind = "charger"
+
+    def __init__(self, addr: int, day_s: float, battery: str):
+        super().__init__(addr, day_s)
+        self.battery = dump_regs(BATTERY_DUMPS[battery])
+        self.charge_ah = 0.0
+        self.discharge_ah = 0.0
+        self.last = time.monotonic()
+
+    def regs(self) -> dict[int, int]:
+        now = time.monotonic()
+        dt_h = (now - self.last) / 3600
+        self.last = now
+
+        sun = self.daylight()
+        solar_w = int(400 * sun + random.uniform(-3, 3) * (sun > 0))
+        solar_w = max(solar_w, 0)
+        solar_dv = int(180 + 20 * sun) if sun > 0 else 0
+        load_w = 12 + random.randint(0, 2)
+        bat_dv = int(124 + 20 * sun + random.uniform(-1, 1))
+        charge_ca = int(solar_w * 1000 / bat_dv)
+        load_ca = int(load_w * 1000 / bat_dv)
+        self.charge_ah += charge_ca / 100 * dt_h
+        self.discharge_ah += load_ca / 100 * dt_h
+        soc = min(100, int(60 + 40 * sun))
+        faults = 0
+
+        model = b"  RNG-CTRL-RVR40"
+        regs = {
+            0x0A: (12 << 8) | 40,
+            0x0B: (20 << 8) | 0,
+            **{0x0C + i: (model[2 * i] << 8) | model[2 * i + 1] for i in range(8)},
+        }
+        for off, val in ((0x14, 0x00010204), (0x16, 0x00010100), (0x18, 0x12345678)):
+            regs[off], regs[off + 1] = u32(val)
+        regs[0x1A] = self.addr
+
+        dyn = [
+            soc, bat_dv, charge_ca,
+            (temp(random.randint(25, 30)) << 8) | temp(random.randint(-5, 20)),
+            bat_dv, load_ca, load_w,
+            solar_dv, int(solar_w * 1000 / solar_dv) if solar_dv else 0, solar_w,
+            0,
+            # Daily
+            bat_dv - 5, bat_dv + 5, charge_ca, load_ca, solar_w, load_w,
+            int(self.charge_ah), int(self.discharge_ah), 12, 3,
+            # Cumulative
+            42, 1, 30,
+            *u32(1000 + int(self.charge_ah)), *u32(800 + int(self.discharge_ah)),
+            *u32(5000), *u32(4000),
+            # Status
+            (0x80 << 8) | (2 if sun > 0 else 0),
+            *u32(faults),
+        ]
+        regs.update({0x100 + i: v for i, v in enumerate(dyn)})
+        regs.update({0xE002 + i: v for i, v in enumerate(self.battery)})
+
+        return regs
+
+
+class Bms(Device):
+    """Renogy smart lithium battery."""
+
+    kind = "BMS"
+
+    def __init__(self, addr: int, day_s: float):
+        super().__init__(addr, day_s)
+        self.remaining_mah = 80000
+        self.last = time.monotonic()
+
+    def regs(self) -> dict[int, int]:
+        now = time.monotonic()
+        current_ca = int(3000 * self.daylight()) - 150
+        self.remaining_mah += current_ca * 10 * (now - self.last) / 3600
+        self.remaining_mah = min(max(self.remaining_mah, 0), 100000)
+        self.last = now
+
+        regs = {5000: 4}
+        vals = [
+            current_ca & 0xFFFF,
+            int(128 + 16 * self.remaining_mah / 100000),
+            *u32(int(self.remaining_mah)),
+            *u32(100000),
+            57,
+        ]
+        regs.update({5042 + i: v for i, v in enumerate(vals)})
+
+        return regs
+
+
+class Bus:
+    def __init__(self, fd: int, devices: list[Device], args: argparse.Namespace):
+        self.fd = fd
+        self.devices = {d.addr: d for d in devices}
+        self.args = args
+        self.buf = b""
+        self.char_s = BITS_PER_CHAR / args.baud
+
+    def respond(self, dev: Device, body: bytes, faults: bool = True):
+        args = self.args
+        if faults and (dev.drop() or random.random() < args.timeout):
+            logger.info("%d: dropping response", dev.addr)
+            return
+
+        if faults and random.random() < args.busy:
+            body = bytes([dev.addr, body[1] | 0x80, EX_DEVICE_BUSY])
+        resp = frame(body)
+        if faults and random.random() < args.crc_error:
+            logger.info("%d: corrupting CRC", dev.addr)
+            resp = resp[:-1] + bytes([resp[-1] ^ 0xFF])
+
+        delay = args.latency + random.uniform(0, args.jitter)
+        time.sleep(delay / 1000 + len(resp) * self.char_s)
+        os.write(self.fd, resp)
+
+    def handle(self, req: bytes):
+        addr, fc = req[0], req[1]
+        dev = self.devices.get(addr)
+        if dev is None:
+            # Nobody home, the client times out as on a real bus
+            return
+
+        if fc == FC_READ_HOLDING:
+            start, count = struct.unpack(">HH", req[2:6])
+            vals = dev.read(start, count) if 1 <= count <= 125 else None
+            logger.debug("%d: read %04x+%d", addr, start, count)
+            if vals is None:
+                self.respond(dev, bytes([addr, fc | 0x80, EX_ILLEGAL_ADDRESS]))
+            else:
+                self.respond(dev, bytes([addr, fc, 2 * count]) + struct.pack(f">{count}H", *vals))
+        elif fc == FC_WRITE_SINGLE:
+            reg, val = struct.unpack(">HH", req[2:6])
+            if reg == SIM_FAULT_REG:
+                logger.info("%d: scripted fault %d", addr, val)
+                dev.fault = val
+                dev.dropped = False
+                self.respond(dev, req[:6], faults=False)
+            else:
+                # Accepted and echoed, but nothing the poller reads changes
+                self.respond(dev, req[:6])
+        else:
+            self.respond(dev, bytes([addr, fc | 0x80, EX_ILLEGAL_FUNCTION]))
+
+    def run(self):
+        while True:
+            self.buf += os.read(self.fd, 256)
+            # Every request the poller sends is 8 bytes, resync on bad CRCs
+            while len(self.buf) >= 8:
+                req = self.buf[:8]
+                if crc16(req) != 0:
+                    self.buf = self.buf[1:]
+                    continue
+                self.buf = self.buf[8:]
+                self.handle(req)
+
+
+def open_port(args: argparse.Namespace) -> int:
+    if args.port:
+        fd = os.open(args.port, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(fd)
+        return fd
+
+    fd, slave = os.openpty()
+    tty.setraw(fd)
+    tty.setraw(slave)
+    name = os.ttyname(slave)
+    if args.link:
+        if os.path.islink(args.link):
+            os.unlink(args.link)
+        os.symlink(name, args.link)
+        name = f"{args.link} -> {name}"
+    print(f"Serving on {name}", flush=True)
+
+    return fd
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--port", help="serial port or pty to serve on, e.g. native_sim's uart_1")
+    parser.add_argument("--link", help="symlink to the new pty when --port isn't given")
+    parser.add_argument("--charger", type=int, action="append", help="charger address, default 1")
+    parser.add_argument("--bms", type=int, action="append", default=[], help="BMS address")
+    parser.add_argument("--battery-type", choices=BATTERY_DUMPS.keys(), default="lithium")
+    parser.add_argument("--day", type=float, default=600.0, help="simulated day length in s")
+    parser.add_argument("--baud", type=int, default=9600)
+    parser.add_argument("--latency", type=float, default=20.0, help="device turnaround in ms")
+    parser.add_argument("--jitter", type=float, default=5.0, help="random extra turnaround in ms")
+    parser.add_argument("--crc-error", type=float, default=0.0, help="share of responses with a bad CRC")
+    parser.add_argument("--timeout", type=float, default=0.0, help="share of requests not answered")
+    parser.add_argument("--busy", type=float, default=0.0, help="share of requests answered busy")
+    parser.add_argument("--seed", type=int, help="seed for repeatable fault injection")
+    parser.add_argument("-v", "--verbose", action="store_true")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO,
+                        format="%(asctime)s %(message)s")
+    random.seed(args.seed)
+
+    devices: list[Device] = [Charger(a, args.day, args.battery_type) for a in args.charger or [1]]
+    devices += [Bms(a, args.day) for a in args.bms]
+    for dev in devices:
+        logger.info("%s at %d", dev.kind, dev.addr)
+
+    try:
+        Bus(open_port(args), devices, args).run()
+    except KeyboardInterrupt:
+        pass
+    except OSError as e:
+        # The pty goes away with the native_sim process
+        logger.error("%s", e)
+        return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
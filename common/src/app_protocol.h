@@ -6,6 +6,7 @@
 #define __LORA_APP_PROTOCOL__
 
 #include <stdint.h>
+#include <zephyr/toolchain.h>
 
 /**
  * LoRa proprietary MHDR
@@ -39,15 +40,93 @@ struct lora_remote_downlink_t {
         uint8_t payload;
 };
 
+/* Authenticated remote frame, which controllers in range may act on directly */
+#define LORA_PROP_TYPE_REMOTE_AUTH	0x02
+#define LORA_PEER_MIC_LEN		4
+
+struct lora_remote_auth_uplink_t {
+        struct lora_prop_uplink_t hdr;
+        uint8_t btn;
+        uint8_t action;
+        uint32_t counter;			/*< Incremented with every frame, never reused */
+        uint8_t mic[LORA_PEER_MIC_LEN];		/*< Truncated AES-CMAC of the preceding bytes */
+} __packed;
+
 /**
  * LoRaWAN port IDs
  */
 
-/* Charger messages. See renogy_internal.h */
+/* Charger messages, encoded from the register tables in renogy_internal.h */
 #define LORAWAN_PORT_CHARGER_SYS	0x10
 #define LORAWAN_PORT_CHARGER_BAT_PARAM	0x11
 #define LORAWAN_PORT_CHARGER_DYN_STATUS	0x12
 #define LORAWAN_PORT_CHARGER_STATS	0x13
+/* Battery BMS status */
+#define LORAWAN_PORT_BMS_STATUS		0x14
+/*
+ * Charger time series: min, max and mean per window of several windows,
+ * oldest first. Each window has, for each channel in lorawan_series_channel_t
+ * order:
+ *   mean   u16 LE in the first window, afterwards the change from the mean of
+ *          the previous window, zigzag varint
+ *   low    mean minus min, varint
+ *   high   max minus mean, varint
+ * Varints are LEB128, 7 bits per byte with the MSB set when more follow.
+ */
+#define LORAWAN_PORT_CHARGER_SERIES	0x15
+
+enum lorawan_series_channel_t {
+	SERIES_BAT_DV,
+	SERIES_CHARGE_CA,
+	SERIES_LOAD_W,
+	SERIES_SOLAR_W,
+	SERIES_NUM_CHANNELS,
+};
+
+struct lorawan_series_uplink_hdr_t {
+	uint8_t count;		/*< Windows in the frame */
+	uint16_t window_s;	/*< Window length */
+} __packed;
+
+/*
+ * Charger fields which changed beyond their deadband since last reported, see
+ * DELTA_FIELDS in delta.h for the fields in bit order. The value of each field
+ * present follows the header as a zigzag varint, in bit order. The full status
+ * and stats frames are still sent as a heartbeat.
+ */
+#define LORAWAN_PORT_CHARGER_DELTA	0x16
+
+struct lorawan_delta_uplink_hdr_t {
+	uint16_t present;	/*< Bitmap of the fields present */
+} __packed;
+
+/*
+ * Request register groups of a charger. The reply goes out on the same port
+ * in one frame, the header followed by each group in bit order, encoded as on
+ * its own port. Groups which couldn't be read or don't fit the frame at the
+ * current datarate are left out of the reply's bitmap.
+ */
+#define LORAWAN_PORT_CHARGER_QUERY	0x17
+
+enum lorawan_charger_query_group_t {
+	QUERY_SYS = (1 << 0),		/*< As on LORAWAN_PORT_CHARGER_SYS */
+	QUERY_BAT = (1 << 1),		/*< As on LORAWAN_PORT_CHARGER_BAT_PARAM */
+	QUERY_STATUS = (1 << 2),	/*< As on LORAWAN_PORT_CHARGER_DYN_STATUS */
+	QUERY_STATS = (1 << 3),		/*< As on LORAWAN_PORT_CHARGER_STATS */
+	QUERY_DAILY = (1 << 4),		/*< REN_DAILY_FIELDS */
+	QUERY_HIST = (1 << 5),		/*< REN_HIST_FIELDS */
+};
+
+struct lorawan_charger_query_downlink_t {
+	uint8_t groups;		/*< Bitmap of lorawan_charger_query_group_t */
+} __packed;
+
+struct lorawan_charger_query_uplink_hdr_t {
+	uint8_t groups;		/*< Groups present in the reply */
+} __packed;
+
+/* The second device of a kind on the bus reports on the same ports plus this */
+#define LORAWAN_PORT_DEV_STRIDE		0x08
 
 /* System info */
 #define LORAWAN_PORT_BOOT_STATUS	0x20
@@ -65,6 +144,17 @@ struct lorawan_update_status_uplink_t {
 	uint16_t expected;
 };
 
+/*
+ * Several records packed into one frame. Each record is the header below
+ * followed by the payload it would have had when sent on its own port.
+ */
+#define LORAWAN_PORT_MULTI		0x30
+
+struct lorawan_multi_record_hdr_t {
+	uint8_t port;
+	uint8_t len;
+} __packed;
+
 #define LORAWAN_PORT_GATE_RELAY		0x80
 #define LORAWAN_PORT_GARAGE0_RELAY	0x81
 #define LORAWAN_PORT_GARAGE1_RELAY	0x82
@@ -75,6 +165,7 @@ enum entrance_state_t {
 	DOOR_STATE_MOVING,
 	DOOR_STATE_MOM_OPEN,  /*< Momentary open */
 	DOOR_STATE_HOLD_OPEN,
+	DOOR_STATE_STOPPED,   /*< Stopped partway by a command */
 };
 
 enum entrance_cmd_t {
@@ -82,17 +173,75 @@ enum entrance_cmd_t {
 	DOOR_CMD_CLOSE,
 	DOOR_CMD_MOM_OPEN,
 	DOOR_CMD_HOLD_OPEN,
+	DOOR_CMD_STOP,        /*< Stop a moving entrance */
+	DOOR_CMD_REVERSE,     /*< Reverse a moving or stopped entrance */
+};
+
+/**
+ * Outcome of the most recent command. A command received while the entrance
+ * is moving is queued and runs when the movement completes.
+ */
+enum entrance_cmd_result_t {
+	DOOR_CMD_RESULT_NONE = 0,
+	DOOR_CMD_RESULT_APPLIED,
+	DOOR_CMD_RESULT_QUEUED,
+	DOOR_CMD_RESULT_IGNORED,
+	DOOR_CMD_RESULT_DUPLICATE,	/*< Same sequence number as the last command, not applied */
 };
 
 struct lorawan_entr_uplink_t {
 	uint8_t state;
 };
 
+/**
+ * Entrance command. The sequence number is optional for compatibility with
+ * single byte commands; a command repeating the sequence number of the
+ * previous one, e.g. a network retransmission, is not applied again.
+ */
 struct lorawan_entr_downlink_t {
 	uint8_t cmd;
+	uint8_t seq;		/*< Command sequence number, 0 or absent if unsequenced */
+};
+
+/**
+ * Aggregated state of every entrance on a controller, sent on state
+ * changes and keepalives in place of per-relay state uplinks. Commands
+ * are still received on the individual relay ports.
+ */
+#define LORAWAN_PORT_ENTR_STATUS	0x88
+
+/* Current state in the low nibble, pending next state in the high nibble */
+#define ENTR_STATUS_STATE(cur, nx)	(((cur) & 0x0F) | (((nx) & 0x0F) << 4))
+/* Queued command in the low nibble, result of the last command in the high nibble */
+#define ENTR_STATUS_CMD(pending, result)	(((pending) & 0x0F) | (((result) & 0x0F) << 4))
+
+struct lorawan_entr_status_t {
+	uint8_t state;		/*< See ENTR_STATUS_STATE */
+	uint8_t eta_s;		/*< Seconds until the next state, 0 if none. Saturates at 255 */
+	uint8_t cmd;		/*< See ENTR_STATUS_CMD */
+	uint8_t cmd_seq;	/*< Sequence number of the command the result is for, 0 if unsequenced */
 };
 
-/* TODO: unimplemented */
+struct lorawan_entr_status_uplink_t {
+	uint8_t seq;		/*< Incremented with every status uplink */
+	uint8_t base_port;	/*< Relay port of the first entrance */
+	uint8_t count;		/*< Number of entrance records */
+	struct lorawan_entr_status_t entr[];
+};
+
+/**
+ * Sent by a controller after acting on an authenticated remote frame received
+ * directly, so the server doesn't act on the same press again.
+ */
+#define LORAWAN_PORT_PEER_EVENT		0x89
+
+struct lorawan_peer_event_uplink_t {
+	uint32_t counter;	/*< Counter of the remote frame */
+	uint8_t btn;
+	uint8_t action;
+	uint8_t result;		/*< See entrance_cmd_result_t */
+} __packed;
+
 #define LORAWAN_PORT_GATE_SCHED		0x90
 
 /**
@@ -103,10 +252,32 @@ struct lorawan_entr_downlink_t {
 struct lorawan_entr_sched_downlink_t {
 	uint64_t hold_start;		/*< Hold start in 64-bit unix epoch */
 	uint32_t hold_duration_s;	/*< Hold duration in seconds */
-};
+	uint8_t entrance;		/*< Entrance index on the controller */
+} __packed;
+
+/**
+ * Recurring daily hold-open rules, stored on the device. Sending a rule
+ * with no days set deletes it.
+ */
+#define LORAWAN_PORT_GATE_RULES		0x91
+
+struct lorawan_entr_rule_downlink_t {
+	uint8_t slot;			/*< Rule slot, up to CONFIG_ENTRANCE_SCHED_MAX_RULES */
+	uint8_t entrance;		/*< Entrance index on the controller */
+	uint8_t days;			/*< Days of the week, bit 0 is Sunday */
+	uint16_t start_min;		/*< Hold start in minutes after midnight UTC */
+	uint16_t duration_min;		/*< Hold duration in minutes, up to 1440 */
+} __packed;
+
+#define SCHED_SLOT_HOLD		0xFF
 
+/**
+ * Confirmation of a schedule or rule downlink, sent on the same port.
+ */
 struct lorawan_entr_sched_uplink_t {
-	/* TODO, confirmation? */
-};
+	uint8_t slot;			/*< Rule slot, or SCHED_SLOT_HOLD for the single hold */
+	int8_t status;			/*< 0 on success, otherwise a negative errno */
+	uint32_t next_start_s;		/*< Seconds until the hold next starts, 0 if not pending */
+} __packed;
 
 #endif
\ No newline at end of file
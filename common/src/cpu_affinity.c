@@ -0,0 +1,73 @@
+#include <zephyr/kernel.h>
+#include <zephyr/init.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+#include "cpu_affinity.h"
+
+LOG_MODULE_REGISTER(cpu_affinity, LOG_LEVEL_INF);
+
+BUILD_ASSERT(CPU_RADIO < CONFIG_MP_MAX_NUM_CPUS && CPU_APP < CONFIG_MP_MAX_NUM_CPUS,
+	     "Entrance CPUs must exist");
+
+/* Kernel and subsystem threads started before the application, by name */
+static const struct {
+	const char *name;
+	int cpu;
+} sys_threads[] = {
+	/* LoRaMAC processing and the radio IRQ handling run here */
+	{ "sysworkq", CPU_RADIO },
+	/* Uplink scheduling, clock sync and multicast sessions, next to the MAC */
+	{ "lorawan_services", CPU_RADIO },
+	/* Flushing the log buffer to the UART can take a while */
+	{ "logging", CPU_APP },
+};
+
+int cpu_affinity_pin(k_tid_t thread, int cpu) {
+	int ret;
+
+	if (thread == k_current_get()) {
+		return -EINVAL;
+	}
+
+	/* The mask can only be changed while the thread can't run */
+	k_thread_suspend(thread);
+	ret = k_thread_cpu_pin(thread, cpu);
+	k_thread_resume(thread);
+
+	if (ret < 0) {
+		LOG_ERR("Failed to pin %s to CPU %d: %d", k_thread_name_get(thread), cpu, ret);
+	} else {
+		LOG_DBG("Pinned %s to CPU %d", k_thread_name_get(thread), cpu);
+	}
+
+	return ret;
+}
+
+static void pin_sys_thread(const struct k_thread *cthread, void *user_data) {
+	k_tid_t thread = (k_tid_t)cthread;
+	const char *name = k_thread_name_get(thread);
+
+	ARG_UNUSED(user_data);
+
+	if (name == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(sys_threads); i++) {
+		if (strcmp(name, sys_threads[i].name) == 0) {
+			cpu_affinity_pin(thread, sys_threads[i].cpu);
+		}
+	}
+}
+
+static int cpu_affinity_init(void) {
+	/* Pinning suspends the thread, which can't be done under the thread
+	 * list lock taken by k_thread_foreach().
+	 */
+	k_thread_foreach_unlocked(pin_sys_thread, NULL);
+
+	return 0;
+}
+
+SYS_INIT(cpu_affinity_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
@@ -0,0 +1,26 @@
+#ifndef __CPU_AFFINITY_H__
+#define __CPU_AFFINITY_H__
+
+#include <zephyr/kernel.h>
+
+#ifdef CONFIG_ENTRANCE_CPU_AFFINITY
+/** CPU running the LoRaWAN MAC, the radio and relay actuation */
+#define CPU_RADIO	CONFIG_ENTRANCE_RADIO_CPU
+/** CPU running Modbus polling, logging and other application work */
+#define CPU_APP		CONFIG_ENTRANCE_APP_CPU
+
+/**
+ * Pin a thread which may already be running to a single CPU. The thread is
+ * briefly suspended to do so, so it must not be the calling thread.
+ */
+int cpu_affinity_pin(k_tid_t thread, int cpu);
+#else
+#define CPU_RADIO	0
+#define CPU_APP		0
+
+static inline int cpu_affinity_pin(k_tid_t thread, int cpu) {
+	return 0;
+}
+#endif
+
+#endif /* __CPU_AFFINITY_H__ */
@@ -0,0 +1,58 @@
+/*
+ * AES block encryption for mbedTLS on the ESP32-S3 AES peripheral, enabled
+ * with CONFIG_ESP32S3_AES_ALT.
+ *
+ * Only the block function is replaced. mbedTLS still expands the key and runs
+ * the modes, CMAC and decryption on top of it. The peripheral takes the raw
+ * key, which is the first round key of the expanded schedule.
+ */
+
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+
+#include <mbedtls/aes.h>
+
+#include <esp_private/periph_ctrl.h>
+#include <hal/aes_hal.h>
+#include <hal/aes_ll.h>
+
+static struct k_spinlock aes_lock;
+static bool aes_enabled;
+
+int mbedtls_internal_aes_encrypt(mbedtls_aes_context *ctx, const unsigned char input[16],
+				 unsigned char output[16]) {
+	const uint32_t *rk = ctx->buf + ctx->rk_offset;
+	k_spinlock_key_t key;
+	size_t key_bytes;
+
+	switch (ctx->nr) {
+		case 10:
+			key_bytes = 16;
+			break;
+		case 14:
+			key_bytes = 32;
+			break;
+		default:
+			/* No AES-192 in hardware */
+			return MBEDTLS_ERR_AES_INVALID_KEY_LENGTH;
+	}
+
+	key = k_spin_lock(&aes_lock);
+
+	if (!aes_enabled) {
+		/* Kept on, keys.c enabling and disabling it again is reference counted */
+		periph_module_enable(PERIPH_AES_MODULE);
+		aes_enabled = true;
+	}
+
+	/* The key is loaded every block, keys.c also uses the peripheral */
+	aes_ll_dma_enable(0);
+	aes_hal_setkey((const uint8_t *)rk, key_bytes, ESP_AES_ENCRYPT);
+	aes_hal_transform_block(input, output);
+
+	k_spin_unlock(&aes_lock, key);
+
+	return 0;
+}
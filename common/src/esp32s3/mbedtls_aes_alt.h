@@ -0,0 +1,7 @@
+#ifndef __MBEDTLS_AES_ALT_H__
+#define __MBEDTLS_AES_ALT_H__
+
+/* mbedTLS user config for CONFIG_ESP32S3_AES_ALT, see aes_alt.c */
+#define MBEDTLS_AES_ENCRYPT_ALT
+
+#endif
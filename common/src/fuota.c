@@ -17,6 +17,8 @@
 #include <app_version.h>
 #include "../lorawan/eui.h"
 #include "app_protocol.h"
+#include "packer.h"
+#include "uplink.h"
 
 LOG_MODULE_REGISTER(lorawan_fuota, CONFIG_LORAWAN_SERVICES_LOG_LEVEL);
 
@@ -64,7 +66,11 @@ void report_version(void)
 	strncpy(&msg.version[0], app_version, sizeof(msg.version));
 	hwinfo_get_reset_cause(&msg.reset_reason);
 
-	lorawan_services_schedule_uplink(LORAWAN_PORT_BOOT_STATUS, (uint8_t *)&msg, sizeof(struct lorawan_boot_status_uplink_t), 500);
+#ifdef CONFIG_LORAWAN_UPLINK_PACKER
+	lorawan_pack_uplink(LORAWAN_PORT_BOOT_STATUS, (uint8_t *)&msg, sizeof(struct lorawan_boot_status_uplink_t));
+#else
+	uplink_submit(UPLINK_PRIO_FUOTA, LORAWAN_PORT_BOOT_STATUS, (uint8_t *)&msg, sizeof(struct lorawan_boot_status_uplink_t));
+#endif
 }
 
 int fuota_run(void) {
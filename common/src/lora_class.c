@@ -0,0 +1,183 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/sys/atomic.h>
+#include <services/lorawan_services.h>
+
+#include "lora_class.h"
+
+LOG_MODULE_REGISTER(lora_class, LOG_LEVEL_INF);
+
+#ifdef CONFIG_ENTRANCE_RX_CLASS_B
+#include "../lorawan/class_b.h"
+
+/* How quickly class C demand from FUOTA is noticed */
+#define POLICY_TICK		K_SECONDS(5)
+/* Time to wait for the beacon before requesting it again */
+#define ACQUISITION_RETRY_MS	(10 * MSEC_PER_SEC * 60)
+/* Longest wait in class A for a FUOTA session to take class C */
+#define FUOTA_SETUP_HOLD_MS	(30 * MSEC_PER_SEC * 60)
+#define SOC_UNKNOWN		0xFF
+
+/* Remote multicast setup package, which starts class C sessions */
+#define MULTICAST_SETUP_PORT	200
+#define MC_CLASS_C_SESSION_REQ	0x04
+
+#define SOC_MIN			CONFIG_ENTRANCE_CLASS_C_SOC_MIN
+#define SOC_HYST		CONFIG_ENTRANCE_CLASS_C_SOC_HYST
+
+static struct k_work_delayable policy_work;
+static atomic_t soc = ATOMIC_INIT(SOC_UNKNOWN);
+/** Whether the battery is healthy enough for class C */
+static bool soc_class_c;
+/** Uptime of the last class B request, 0 if none */
+static int64_t requested_at;
+/** 32-bit uptime of the last class C session request, 0 if none */
+static atomic_t fuota_setup_at;
+
+static void update_soc_class_c(void) {
+	atomic_val_t pct = atomic_get(&soc);
+
+	if (pct == SOC_UNKNOWN) {
+		return;
+	}
+
+	if (!soc_class_c && pct >= SOC_MIN) {
+		LOG_INF("Battery at %ld%%, switching to class C", pct);
+		soc_class_c = true;
+	} else if (soc_class_c && pct + SOC_HYST < SOC_MIN) {
+		LOG_INF("Battery at %ld%%, leaving class C", pct);
+		soc_class_c = false;
+	}
+}
+
+/*
+ * The MAC only leaves class B for class A, and the services switch between
+ * class A and C, so every change goes through class A.
+ */
+static int set_class(enum lorawan_class cur, enum lorawan_class cls) {
+	int ret;
+
+	if (cur == cls) {
+		return 0;
+	}
+
+	if (cur != LORAWAN_CLASS_A) {
+		ret = lorawan_set_class(LORAWAN_CLASS_A);
+		if (ret < 0) {
+			LOG_ERR("Failed to switch to class A: %d", ret);
+			return ret;
+		}
+	}
+
+	if (cls != LORAWAN_CLASS_A) {
+		ret = lorawan_set_class(cls);
+		if (ret < 0) {
+			LOG_ERR("Failed to switch to class %c: %d", 'A' + cls, ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static bool fuota_setup_pending(void) {
+	uint32_t at = atomic_get(&fuota_setup_at);
+
+	if (at == 0) {
+		return false;
+	}
+
+	if (lorawan_services_class_c_active() > 0 ||
+	    k_uptime_get_32() - at > FUOTA_SETUP_HOLD_MS) {
+		/* The session started, or never will */
+		atomic_set(&fuota_setup_at, 0);
+		return false;
+	}
+
+	return true;
+}
+
+static void policy_work_handler(struct k_work *work) {
+	enum lorawan_class cls = lorawan_class_get();
+
+	update_soc_class_c();
+
+	if (lorawan_services_class_c_active() > 0) {
+		/* A FUOTA session holds class C and switches back when it ends */
+	} else if (fuota_setup_pending()) {
+		/* Be in class A when the session starts, the services can't leave
+		 * class B or enter class C from class C.
+		 */
+		set_class(cls, LORAWAN_CLASS_A);
+	} else if (soc_class_c) {
+		if (cls != LORAWAN_CLASS_C && set_class(cls, LORAWAN_CLASS_C) == 0) {
+			LOG_INF("Switched to class C");
+		}
+	} else if (cls != LORAWAN_CLASS_B) {
+		if (set_class(cls, LORAWAN_CLASS_A) < 0) {
+			goto out;
+		}
+
+		if (lorawan_class_b_enable() == 0) {
+			LOG_INF("Switched to class B");
+		} else if (requested_at == 0 ||
+			   k_uptime_get() - requested_at > ACQUISITION_RETRY_MS) {
+			/* Not set up yet, or the beacon was lost */
+			LOG_INF("Requesting class B ping slots");
+			if (lorawan_class_b_request(CONFIG_ENTRANCE_PING_SLOT_PERIODICITY) == 0) {
+				requested_at = k_uptime_get();
+			}
+		}
+	}
+
+out:
+	lorawan_services_reschedule_work(&policy_work, POLICY_TICK);
+}
+
+static void multicast_setup_downlink(uint8_t port, uint8_t flags, int16_t rssi, int8_t snr,
+				     uint8_t len, const uint8_t *data, void *context)
+{
+	/* Payload length of each command of the package, by command ID */
+	static const uint8_t cmd_len[] = { 0, 1, 29, 1, 10, 10 };
+
+	/* The services handle the commands, this only makes room for the session */
+	for (int i = 0; i < len && data[i] < ARRAY_SIZE(cmd_len); i += 1 + cmd_len[data[i]]) {
+		if (data[i] == MC_CLASS_C_SESSION_REQ) {
+			LOG_INF("Class C session requested, leaving class B");
+			atomic_set(&fuota_setup_at, MAX(k_uptime_get_32(), 1));
+			lorawan_services_reschedule_work(&policy_work, K_NO_WAIT);
+			return;
+		}
+	}
+}
+
+static struct lorawan_downlink_cb multicast_setup_cb = {
+	.port = MULTICAST_SETUP_PORT,
+	.cb = multicast_setup_downlink,
+};
+
+void lora_class_set_soc(uint8_t soc_pct) {
+	atomic_set(&soc, MIN(soc_pct, 100));
+}
+
+int lora_class_run(void) {
+	k_work_init_delayable(&policy_work, policy_work_handler);
+	lorawan_register_downlink_callback(&multicast_setup_cb);
+	lorawan_services_reschedule_work(&policy_work, K_NO_WAIT);
+
+	return 0;
+}
+
+#else
+
+void lora_class_set_soc(uint8_t soc_pct) {
+	ARG_UNUSED(soc_pct);
+}
+
+int lora_class_run(void) {
+	/* Switch to class C for lower-latency relay response */
+	return lorawan_services_class_c_start();
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef __LORA_CLASS_H__
+#define __LORA_CLASS_H__
+
+#include <stdint.h>
+
+/**
+ * Start the receive class policy: either class C throughout, or class B with
+ * class C while the battery is healthy or a FUOTA session needs it.
+ */
+int lora_class_run(void);
+
+/**
+ * Report the battery state of charge in percent, which decides whether class
+ * C can be afforded.
+ */
+void lora_class_set_soc(uint8_t soc_pct);
+
+#endif /* __LORA_CLASS_H__ */
@@ -0,0 +1,120 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <services/lorawan_services.h>
+
+#include <string.h>
+
+#include "app_protocol.h"
+#include "packer.h"
+#include "uplink.h"
+
+LOG_MODULE_REGISTER(packer, LOG_LEVEL_INF);
+
+#define HDR_LEN		sizeof(struct lorawan_multi_record_hdr_t)
+#define FRAME_SIZE	CONFIG_LORAWAN_SERVICES_MAX_UPLINK_SIZE
+
+/* Records as they go into a frame, header and data */
+static uint8_t pending[CONFIG_LORAWAN_UPLINK_PACK_BUF_SIZE];
+static size_t pending_len;
+static K_MUTEX_DEFINE(pack_lock);
+
+static void flush_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(flush_work, flush_work_handler);
+
+static void send(uint8_t port, uint8_t *data, size_t len) {
+	int ret;
+
+	ret = uplink_submit(UPLINK_PRIO_TELEMETRY, port, data, len);
+	if (ret < 0) {
+		LOG_ERR("Failed to schedule uplink on port %d: %d", port, ret);
+	}
+}
+
+/**
+ * Send a frame of records. A lone record goes out on its own port, which
+ * saves the record header.
+ */
+static void send_frame(uint8_t *frame, size_t len, int records) {
+	if (records == 1) {
+		send(frame[0], frame + HDR_LEN, len - HDR_LEN);
+	} else if (records > 1) {
+		LOG_DBG("Packed %d records into %zu bytes", records, len);
+		send(LORAWAN_PORT_MULTI, frame, len);
+	}
+}
+
+static void flush_locked(void) {
+	uint8_t frame[FRAME_SIZE];
+	uint8_t max_next, max;
+	size_t limit, frame_len = 0;
+	int records = 0;
+
+	/* The next frame may carry MAC commands, leaving less room */
+	lorawan_get_payload_sizes(&max_next, &max);
+	limit = MIN(max_next, sizeof(frame));
+
+	for (size_t off = 0; off < pending_len;) {
+		uint8_t *rec = &pending[off];
+		size_t rec_len = HDR_LEN + rec[1];
+
+		if (rec_len > limit && rec_len - HDR_LEN <= sizeof(frame)) {
+			/* Doesn't fit a frame at this datarate even by itself */
+			send(rec[0], rec + HDR_LEN, rec_len - HDR_LEN);
+		} else if (rec_len <= limit) {
+			if (frame_len + rec_len > limit) {
+				send_frame(frame, frame_len, records);
+				frame_len = 0;
+				records = 0;
+			}
+			memcpy(&frame[frame_len], rec, rec_len);
+			frame_len += rec_len;
+			records++;
+		} else {
+			LOG_ERR("Dropping %zu byte record for port %d", rec_len - HDR_LEN, rec[0]);
+		}
+
+		off += rec_len;
+	}
+
+	send_frame(frame, frame_len, records);
+	pending_len = 0;
+}
+
+static void flush_work_handler(struct k_work *work) {
+	lorawan_pack_flush();
+}
+
+void lorawan_pack_flush(void) {
+	k_mutex_lock(&pack_lock, K_FOREVER);
+	flush_locked();
+	k_mutex_unlock(&pack_lock);
+}
+
+int lorawan_pack_uplink(uint8_t port, const uint8_t *data, size_t len) {
+	struct lorawan_multi_record_hdr_t hdr = {
+		.port = port,
+		.len = len,
+	};
+
+	if (len > UINT8_MAX || HDR_LEN + len > sizeof(pending)) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&pack_lock, K_FOREVER);
+
+	if (pending_len + HDR_LEN + len > sizeof(pending)) {
+		flush_locked();
+	}
+
+	memcpy(&pending[pending_len], &hdr, HDR_LEN);
+	memcpy(&pending[pending_len + HDR_LEN], data, len);
+	pending_len += HDR_LEN + len;
+
+	k_mutex_unlock(&pack_lock);
+
+	/* Collect whatever else is reported around the same time */
+	k_work_schedule(&flush_work, K_MSEC(CONFIG_LORAWAN_UPLINK_PACK_DELAY_MS));
+
+	return 0;
+}
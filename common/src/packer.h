@@ -0,0 +1,19 @@
+#ifndef __PACKER_H__
+#define __PACKER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Queue an uplink record to be packed with others into as few frames as the
+ * current datarate allows, see LORAWAN_PORT_MULTI. Records are sent
+ * CONFIG_LORAWAN_UPLINK_PACK_DELAY_MS after the first one was queued.
+ *
+ * @param port Port the record would be sent on by itself
+ */
+int lorawan_pack_uplink(uint8_t port, const uint8_t *data, size_t len);
+
+/** Send all queued records now */
+void lorawan_pack_flush(void);
+
+#endif /* __PACKER_H__ */
@@ -0,0 +1,137 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/settings/settings.h>
+#include <services/lorawan_services.h>
+
+#include <string.h>
+
+#include "app_protocol.h"
+#include "relay.h"
+#include "peer.h"
+#include "uplink.h"
+#include "../lorawan/peer_auth.h"
+
+LOG_MODULE_REGISTER(peer, LOG_LEVEL_DBG);
+
+/*
+ * Remotes send a copy of their authenticated frame on the class C receive
+ * channel. LoRaMAC hands proprietary frames up like any other downlink, with
+ * the MHDR stripped, on port 0.
+ */
+
+/* Gestures, as encoded by the remote buttons */
+#define GESTURE_SHORT		0x02
+#define GESTURE_LONG		0x03
+#define GESTURE_DOUBLE_SHORT	0x0A
+
+#define AUTH_FRAME_LEN		sizeof(struct lora_remote_auth_uplink_t)
+#define AUTH_MIC_OFFSET		offsetof(struct lora_remote_auth_uplink_t, mic)
+
+/** Counter of the last frame acted on, to reject replays */
+static uint32_t last_counter;
+
+/**
+ * The command for a whitelisted gesture, 0 if the gesture is left to the server.
+ */
+static enum entrance_cmd_t gesture_cmd(uint8_t action) {
+	switch (action) {
+		case GESTURE_SHORT:
+			return IS_ENABLED(CONFIG_ENTRANCE_PEER_SHORT_TOGGLE) ?
+				DOOR_CMD_TOGGLE : DOOR_CMD_MOM_OPEN;
+		case GESTURE_LONG:
+			return DOOR_CMD_HOLD_OPEN;
+		case GESTURE_DOUBLE_SHORT:
+			return DOOR_CMD_CLOSE;
+		default:
+			return 0;
+	}
+}
+
+static void peer_downlink(uint8_t port, uint8_t flags, int16_t rssi, int8_t snr, uint8_t len,
+			  const uint8_t *data, void *context)
+{
+	uint8_t frame[AUTH_FRAME_LEN];
+	struct lora_remote_auth_uplink_t msg;
+	struct lorawan_peer_event_uplink_t event;
+	enum entrance_cmd_t cmd;
+	int entrance;
+	int ret;
+
+	/* The MHDR is not passed up */
+	if (port != 0 || !data || len != AUTH_FRAME_LEN - 1 || data[0] != LORA_PROP_TYPE_REMOTE_AUTH) {
+		return;
+	}
+
+	frame[0] = LORA_MHDR_PROPRIETARY;
+	memcpy(&frame[1], data, len);
+	if (!lora_peer_verify(frame, AUTH_MIC_OFFSET, &frame[AUTH_MIC_OFFSET])) {
+		LOG_WRN("Remote frame failed authentication");
+		return;
+	}
+	memcpy(&msg, frame, sizeof(msg));
+
+	if (msg.counter <= last_counter) {
+		LOG_WRN("Replayed remote frame %u", msg.counter);
+		return;
+	}
+
+	entrance = msg.btn - CONFIG_ENTRANCE_PEER_BTN_BASE;
+	cmd = gesture_cmd(msg.action);
+	if (entrance < 0 || entrance >= relay_count() || cmd == 0) {
+		/* Not ours, the server handles it */
+		return;
+	}
+
+	last_counter = msg.counter;
+	ret = settings_save_one("peer/ctr", &last_counter, sizeof(last_counter));
+	if (ret < 0) {
+		LOG_ERR("Failed to store remote counter: %d", ret);
+	}
+
+	LOG_INF("Remote button %d action 0x%02x, RSSI %ddB SNR %ddB", msg.btn, msg.action, rssi, snr);
+	relay_command(entrance, cmd);
+
+	event.counter = msg.counter;
+	event.btn = msg.btn;
+	event.action = msg.action;
+	event.result = relay_cmd_result(entrance);
+	uplink_submit(UPLINK_PRIO_STATE, LORAWAN_PORT_PEER_EVENT, (uint8_t *)&event, sizeof(event));
+}
+
+/* This callback must have a static lifetime */
+static struct lorawan_downlink_cb downlink_cb = {
+	.port = LW_RECV_PORT_ANY,
+	.cb = peer_downlink,
+};
+
+static int peer_settings_set(const char *name, size_t len, settings_read_cb read_cb,
+			     void *cb_arg)
+{
+	ssize_t ret;
+
+	if (strcmp(name, "ctr") != 0) {
+		return -ENOENT;
+	}
+	if (len != sizeof(last_counter)) {
+		return -EINVAL;
+	}
+
+	ret = read_cb(cb_arg, &last_counter, sizeof(last_counter));
+	return ret < 0 ? ret : 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(peer, "peer", NULL, peer_settings_set, NULL, NULL);
+
+int lorawan_peer_run(void) {
+	int ret;
+
+	ret = settings_load_subtree("peer");
+	if (ret < 0) {
+		LOG_ERR("Failed to load remote counter: %d", ret);
+	}
+
+	lorawan_register_downlink_callback(&downlink_cb);
+
+	return 0;
+}
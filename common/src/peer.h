@@ -0,0 +1,16 @@
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#ifdef CONFIG_ENTRANCE_PEER
+/**
+ * Act on authenticated remote frames received directly. Requires the relay
+ * service to be running.
+ */
+int lorawan_peer_run(void);
+#else
+static inline int lorawan_peer_run(void) {
+	return 0;
+}
+#endif
+
+#endif /* __PEER_H__ */
@@ -1,51 +1,190 @@
 #include <zephyr/device.h>
 #include <zephyr/kernel.h>
+#include <zephyr/drivers/counter.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/lorawan/lorawan.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/barrier.h>
+#include <zephyr/stats/stats.h>
 #include <services/lorawan_services.h>
 
+#include <stdlib.h>
+
 #include "app_protocol.h"
+#include "lora_class.h"
+#include "cpu_affinity.h"
+#include "uplink.h"
 
 LOG_MODULE_REGISTER(relay, LOG_LEVEL_DBG);
 
-static const struct gpio_dt_spec relays[] = {
-#if DT_NODE_EXISTS(DT_ALIAS(relay0))
-	GPIO_DT_SPEC_GET(DT_ALIAS(relay0), gpios),
-#if DT_NODE_EXISTS(DT_ALIAS(relay1))
-	GPIO_DT_SPEC_GET(DT_ALIAS(relay1), gpios),
-#endif
+/* Entrances are the children of the `entrance-relays` node, in port order. Everything
+ * per entrance is generated from these at compile time, indexed by ENTR_IDX(node).
+ */
+#define ENTRANCES_NODE		DT_COMPAT_GET_ANY_STATUS_OKAY(entrance_relays)
+#define ENTR_IDX(node)		_CONCAT(ENTR_IDX_, node)
+
+#if DT_NODE_EXISTS(ENTRANCES_NODE)
+#define ENTR_FOREACH(fn)	DT_FOREACH_CHILD_STATUS_OKAY(ENTRANCES_NODE, fn)
+#define ENTR_IDX_ENUM(node)	ENTR_IDX(node),
+enum {
+	ENTR_FOREACH(ENTR_IDX_ENUM)
+	NUM_ENTRANCES
+};
+#else
+#define NUM_ENTRANCES		0
+#define ENTR_FOREACH(fn)
 #endif
+
+BUILD_ASSERT(CONFIG_LORAWAN_PORT_RELAY_BASE + NUM_ENTRANCES <= LORAWAN_PORT_ENTR_STATUS,
+	     "Entrance ports overlap the status port");
+
+#define RELAY_DT_SPEC(node)	[ENTR_IDX(node)] = GPIO_DT_SPEC_GET(node, gpios),
+static const struct gpio_dt_spec relays[] = {
+	ENTR_FOREACH(RELAY_DT_SPEC)
+};
+
+/* Optional position sensors (limit or reed switches), active when the entrance
+ * has arrived at the respective position. An empty spec means there is no sensor.
+ */
+#define CLOSED_DT_SPEC(node)	[ENTR_IDX(node)] = GPIO_DT_SPEC_GET_OR(node, closed_gpios, {0}),
+#define OPEN_DT_SPEC(node)	[ENTR_IDX(node)] = GPIO_DT_SPEC_GET_OR(node, open_gpios, {0}),
+static const struct gpio_dt_spec closed_sensors[] = {
+	ENTR_FOREACH(CLOSED_DT_SPEC)
+};
+static const struct gpio_dt_spec open_sensors[] = {
+	ENTR_FOREACH(OPEN_DT_SPEC)
+};
+
+/**
+ * Entrance state as published to lock-free readers.
+ */
+struct entr_snapshot {
+	int64_t transition;
+	uint8_t state;
+	uint8_t nx_state;
+	uint8_t pending_cmd;
+	uint8_t cmd_result;
+	uint8_t cmd_seq;
 };
 
 struct relay_svc_context {
+	/** Protects the entrance state. Held while handling commands and transitions. */
+	struct k_mutex lock;
+	/** Protects the relay actuation timing below, which is also used from the work queue */
+	struct k_spinlock relay_lock;
 	/** The relay GPIO */
 	const struct gpio_dt_spec *relay;
-	/** Work item for regular uplink messages */
-	struct k_work_delayable uplink_work;
+	/** The closed position sensor GPIO, NULL if absent */
+	const struct gpio_dt_spec *closed_sensor;
+	/** The open position sensor GPIO, NULL if absent */
+	const struct gpio_dt_spec *open_sensor;
+	/** Edge interrupt callbacks for the position sensors */
+	struct gpio_callback closed_cb;
+	struct gpio_callback open_cb;
+	/** Work item for debouncing and evaluating the position sensors */
+	struct k_work_delayable sensor_work;
 	/** Work item for maintaining the entrance state */
 	struct k_work_delayable entr_state_work;
-	/** Work item for managing relay close duration */
-	struct k_work_delayable open_relay_work;
-	/** Keepalive retransmission interval in milliseconds */
-	uint32_t period;
+	/** Work item for ending relay pulses and running pulse trains, on the relay work queue */
+	struct k_work_delayable relay_work;
+	/** Time in ticks to open the relay, 0 if it is open or held closed */
+	int64_t release_at;
+	/** Time in ticks to close the relay for the next pulse in a train, 0 if none */
+	int64_t repulse_at;
+	/** Cycle count when the relay last closed, and the intended pulse width */
+	uint32_t closed_cyc;
+	uint32_t pulse_ms;
+	/** Cycle count when the command being applied was received, 0 if not from a downlink */
+	uint32_t rx_cyc;
+	/** Pulse timer alarm channel */
+	uint8_t chan;
 	/** The next time in ticks that the entrance is expected to change state. */
 	int64_t entr_transition;
 	/** The current (software) state of the relays */
 	enum entrance_state_t entr_state;
 	/** The next (software) state of the relays */
 	enum entrance_state_t nx_entr_state;
+	/** The position the entrance was heading to when stopped */
+	enum entrance_state_t stop_target;
+	/** Command waiting for the current movement to complete, 0 if none */
+	enum entrance_cmd_t pending_cmd;
+	/** Result of the most recent command */
+	enum entrance_cmd_result_t cmd_result;
+	/** Sequence number of the most recent command, 0 if unsequenced */
+	uint8_t cmd_seq;
+	/** The last sequenced command and its sequence number, for dropping repeats */
+	enum entrance_cmd_t last_cmd;
+	uint8_t last_seq;
+	/** Uptime the last sequenced command was received at */
+	int64_t last_seq_at;
+	/** Relay pulses remaining after the current one */
+	uint8_t extra_pulses;
 	/** The LoRaWAN port number */
 	uint8_t port;
+	/** Double-buffered state snapshot, the active buffer is selected by the low bit
+	 * of the sequence number.
+	 */
+	struct entr_snapshot snap[2];
+	atomic_t snap_seq;
+};
+
+#define SENSOR_PTR(node, prop, specs) \
+	COND_CODE_1(DT_NODE_HAS_PROP(node, prop), (&specs[ENTR_IDX(node)]), (NULL))
+
+#define ENTR_CTX(node)								\
+	[ENTR_IDX(node)] = {							\
+		.relay = &relays[ENTR_IDX(node)],				\
+		.closed_sensor = SENSOR_PTR(node, closed_gpios, closed_sensors),\
+		.open_sensor = SENSOR_PTR(node, open_gpios, open_sensors),	\
+		.port = CONFIG_LORAWAN_PORT_RELAY_BASE + ENTR_IDX(node),	\
+		.chan = ENTR_IDX(node),						\
+	},
+
+static struct relay_svc_context ctx[NUM_ENTRANCES] = {
+	ENTR_FOREACH(ENTR_CTX)
 };
 
-K_SEM_DEFINE(ctx_sem, 1, 1);
-static struct relay_svc_context ctx[ARRAY_SIZE(relays)];
+static K_THREAD_STACK_DEFINE(relay_workq_stack, CONFIG_ENTRANCE_RELAY_WORKQ_STACK_SIZE);
+static struct k_work_q relay_workq;
+
+#ifdef CONFIG_ENTRANCE_RELAY_PULSE_TIMER
+static const struct device *const pulse_timer = DEVICE_DT_GET(DT_CHOSEN(entrance_pulse_timer));
+#endif
+
+STATS_SECT_START(relay_stats)
+STATS_SECT_ENTRY32(pulses)
+STATS_SECT_ENTRY32(pulse_err_us)
+STATS_SECT_ENTRY32(pulse_err_max_us)
+STATS_SECT_ENTRY32(cmd_latency_us)
+STATS_SECT_ENTRY32(cmd_latency_max_us)
+STATS_SECT_END;
+
+STATS_NAME_START(relay_stats)
+STATS_NAME(relay_stats, pulses)
+STATS_NAME(relay_stats, pulse_err_us)
+STATS_NAME(relay_stats, pulse_err_max_us)
+STATS_NAME(relay_stats, cmd_latency_us)
+STATS_NAME(relay_stats, cmd_latency_max_us)
+STATS_NAME_END(relay_stats);
+
+/** Pulse width error and downlink to contact latency */
+STATS_SECT_DECL(relay_stats) relay_stats;
+static uint32_t pulse_err_max_us;
+static uint32_t cmd_latency_max_us;
+
+/** Work item for the aggregated status uplink */
+static struct k_work_delayable status_work;
+/** Current keepalive retransmission interval in seconds */
+static atomic_t status_period;
+/** Status uplink sequence number */
+static uint8_t status_seq;
 
 #define RELAY_CLOSED	1
 #define RELAY_OPEN	0
 
 #define MOVEMENT_TICKS	k_sec_to_ticks_ceil64(CONFIG_ENTRANCE_MOVEMENT_DURATION)
+#define FAULT_TICKS	k_sec_to_ticks_ceil64(CONFIG_ENTRANCE_MOVEMENT_TIMEOUT)
 #ifdef CONFIG_ENTRANCE_HAS_AUTO_CLOSE
 #define HAS_AUTO_CLOSE	1
 #define AUTOCLOSE_TICKS	k_sec_to_ticks_ceil64(CONFIG_ENTRANCE_AUTO_CLOSE_INTERVAL)
@@ -54,45 +193,381 @@ static struct relay_svc_context ctx[ARRAY_SIZE(relays)];
 #define AUTOCLOSE_TICKS	0
 #endif
 
-static void close_relay(struct relay_svc_context *ctx, uint32_t duration_ms) {
-	struct k_work_sync sync;
+#ifdef CONFIG_ENTRANCE_STOP_ON_PULSE
+#define STOP_ON_PULSE	1
+#else
+#define STOP_ON_PULSE	0
+#endif
+
+/*
+ * A command repeated with the same sequence number within this time is a
+ * retry of the same request. gate_ctrl.py stops reusing a sequence number well
+ * before, so a later repeat is a new request that wrapped onto the same number.
+ */
+#define CMD_DEDUP_WINDOW_MS	(60 * MSEC_PER_SEC)
+
+#define KEEPALIVE_MIN_S	CONFIG_ENTRANCE_KEEPALIVE_MIN_INTERVAL
+#define KEEPALIVE_MAX_S	CONFIG_ENTRANCE_KEEPALIVE_MAX_INTERVAL
+
+BUILD_ASSERT(KEEPALIVE_MIN_S <= KEEPALIVE_MAX_S, "Keepalive minimum interval exceeds the maximum");
+
+/**
+ * Restart the keepalive backoff and schedule the next status uplink.
+ */
+static void reset_keepalive(k_timeout_t delay) {
+	atomic_set(&status_period, KEEPALIVE_MIN_S);
+	lorawan_services_reschedule_work(&status_work, delay);
+}
+
+/**
+ * Publish the entrance state to readers. The writers are serialized by the context
+ * lock, so the inactive buffer can be filled in before flipping the sequence number.
+ */
+static void publish_snapshot(struct relay_svc_context *ctx) {
+	atomic_val_t seq = atomic_get(&ctx->snap_seq) + 1;
+	struct entr_snapshot *snap = &ctx->snap[seq & 1];
+
+	snap->transition = ctx->entr_transition;
+	snap->state = ctx->entr_state;
+	snap->nx_state = ctx->nx_entr_state;
+	snap->pending_cmd = ctx->pending_cmd;
+	snap->cmd_result = ctx->cmd_result;
+	snap->cmd_seq = ctx->cmd_seq;
+	atomic_set(&ctx->snap_seq, seq);
+}
+
+/**
+ * Read the entrance state without blocking. Only retries if the state was published
+ * again while copying.
+ */
+static void read_snapshot(const struct relay_svc_context *ctx, struct entr_snapshot *out) {
+	atomic_val_t seq;
+
+	do {
+		seq = atomic_get(&ctx->snap_seq);
+		*out = ctx->snap[seq & 1];
+		/* The copy must complete before the sequence number is checked again */
+		barrier_dmem_fence_full();
+	} while (atomic_get(&ctx->snap_seq) != seq);
+}
+
+static inline void ctx_lock(struct relay_svc_context *ctx) {
+	k_mutex_lock(&ctx->lock, K_FOREVER);
+}
+
+static inline void ctx_unlock(struct relay_svc_context *ctx) {
+	publish_snapshot(ctx);
+	k_mutex_unlock(&ctx->lock);
+}
+
+static inline bool is_open_state(enum entrance_state_t state) {
+	return state == DOOR_STATE_MOM_OPEN || state == DOOR_STATE_HOLD_OPEN;
+}
+
+static inline bool sensor_active(const struct gpio_dt_spec *sensor) {
+	return sensor != NULL && gpio_pin_get_dt(sensor) > 0;
+}
+
+/**
+ * The open state an entrance arriving at the open position ends up in.
+ */
+static enum entrance_state_t open_state(const struct relay_svc_context *ctx) {
+	if (ctx->entr_state == DOOR_STATE_MOVING && is_open_state(ctx->nx_entr_state)) {
+		return ctx->nx_entr_state;
+	}
+
+	return HAS_AUTO_CLOSE ? DOOR_STATE_MOM_OPEN : DOOR_STATE_HOLD_OPEN;
+}
 
-	/* Cancel work if it exists */
-	k_work_cancel_delayable_sync(&ctx->open_relay_work, &sync);
-	gpio_pin_set_dt(ctx->relay, 1);
-	if (duration_ms > 0) {
-		/* Duration of 0 means leave closed */
+/**
+ * The state reported by the position sensors, or DOOR_STATE_UNKNOWN if no
+ * sensor is active.
+ */
+static enum entrance_state_t sensor_state(const struct relay_svc_context *ctx) {
+	if (sensor_active(ctx->closed_sensor)) {
+		return DOOR_STATE_CLOSED;
+	}
+	if (sensor_active(ctx->open_sensor)) {
+		return open_state(ctx);
+	}
+
+	return DOOR_STATE_UNKNOWN;
+}
+
+/**
+ * Whether a sensor reports arrival at the given state. If so, the movement
+ * timer is only a fault timeout.
+ */
+static bool has_sensor_for(const struct relay_svc_context *ctx, enum entrance_state_t state) {
+	if (state == DOOR_STATE_CLOSED) {
+		return ctx->closed_sensor != NULL;
+	}
+
+	return is_open_state(state) && ctx->open_sensor != NULL;
+}
+
+static int64_t movement_ticks(const struct relay_svc_context *ctx, enum entrance_state_t target) {
+	return has_sensor_for(ctx, target) ? FAULT_TICKS : MOVEMENT_TICKS;
+}
+
+#ifdef CONFIG_ENTRANCE_RELAY_PULSE_TIMER
+static void end_pulse(struct relay_svc_context *ctx, int64_t now);
+
+static void pulse_alarm_handler(const struct device *dev, uint8_t chan, uint32_t ticks, void *user_data) {
+	struct relay_svc_context *ctx = user_data;
+	k_spinlock_key_t key = k_spin_lock(&ctx->relay_lock);
+	int64_t next = 0;
+
+	if (ctx->release_at > 0) {
+		end_pulse(ctx, k_uptime_ticks());
+		next = ctx->repulse_at;
+	}
+	k_spin_unlock(&ctx->relay_lock, key);
+
+	if (next > 0) {
+		k_work_reschedule_for_queue(&relay_workq, &ctx->relay_work, K_TIMEOUT_ABS_TICKS(next));
+	}
+}
+#endif
+
+/**
+ * Close the relay and return the time in ticks it opens again, 0 to hold it closed.
+ * Must be called with the relay lock held.
+ */
+static int64_t start_pulse(struct relay_svc_context *ctx, uint32_t duration_ms) {
+	gpio_pin_set_dt(ctx->relay, RELAY_CLOSED);
+	ctx->closed_cyc = k_cycle_get_32();
+	ctx->pulse_ms = duration_ms;
+	ctx->release_at = 0;
+	if (duration_ms == 0) {
+		return 0;
+	}
+
+	ctx->release_at = k_uptime_ticks() + k_ms_to_ticks_ceil64(duration_ms);
+#ifdef CONFIG_ENTRANCE_RELAY_PULSE_TIMER
+	struct counter_alarm_cfg alarm = {
+		.callback = pulse_alarm_handler,
+		.ticks = counter_us_to_ticks(pulse_timer, (uint64_t)duration_ms * USEC_PER_MSEC),
+		.user_data = ctx,
+		.flags = 0,
+	};
+
+	/* The work item remains as a backstop, and finds nothing due if the alarm fired */
+	counter_cancel_channel_alarm(pulse_timer, ctx->chan);
+	counter_set_channel_alarm(pulse_timer, ctx->chan, &alarm);
+#endif
+	return ctx->release_at;
+}
+
+/**
+ * Open the relay at the end of a pulse and queue the next one in a train.
+ * Must be called with the relay lock held.
+ */
+static void end_pulse(struct relay_svc_context *ctx, int64_t now) {
+	gpio_pin_set_dt(ctx->relay, RELAY_OPEN);
+
+	uint32_t width_us = k_cyc_to_us_floor32(k_cycle_get_32() - ctx->closed_cyc);
+	uint32_t err_us = abs((int32_t)(width_us - ctx->pulse_ms * USEC_PER_MSEC));
+
+	pulse_err_max_us = MAX(pulse_err_max_us, err_us);
+	STATS_INC(relay_stats, pulses);
+	STATS_SET(relay_stats, pulse_err_us, err_us);
+	STATS_SET(relay_stats, pulse_err_max_us, pulse_err_max_us);
+
+	ctx->release_at = 0;
+	if (ctx->extra_pulses > 0) {
+		ctx->extra_pulses--;
+		ctx->repulse_at = now + k_ms_to_ticks_ceil64(CONFIG_ENTRANCE_REVERSE_DELAY_MS);
+	}
+}
+
+/**
+ * Close the relay for `duration_ms`, followed by `extra_pulses` further pulses. A
+ * duration of 0 holds the relay closed.
+ *
+ * The relay closes right away in the calling context; ending the pulse is left to the
+ * relay work queue or the pulse timer. This never waits on the relay work: the
+ * deadlines are replaced under the relay lock, and a stale run of the work just finds
+ * nothing due and goes back to sleep.
+ */
+static void actuate_relay(struct relay_svc_context *ctx, uint32_t duration_ms, uint8_t extra_pulses) {
+	k_spinlock_key_t key = k_spin_lock(&ctx->relay_lock);
+	int64_t release_at = start_pulse(ctx, duration_ms);
+
+	ctx->repulse_at = 0;
+	ctx->extra_pulses = extra_pulses;
+	k_spin_unlock(&ctx->relay_lock, key);
+
+	if (ctx->rx_cyc != 0) {
+		uint32_t latency_us = k_cyc_to_us_floor32(ctx->closed_cyc - ctx->rx_cyc);
+
+		cmd_latency_max_us = MAX(cmd_latency_max_us, latency_us);
+		STATS_SET(relay_stats, cmd_latency_us, latency_us);
+		STATS_SET(relay_stats, cmd_latency_max_us, cmd_latency_max_us);
+		ctx->rx_cyc = 0;
+	}
+
+	if (release_at > 0) {
 		LOG_DBG("Closing relay for %d ms", duration_ms);
-		k_work_schedule_for_queue(&k_sys_work_q, &ctx->open_relay_work, K_MSEC(duration_ms));
+		k_work_reschedule_for_queue(&relay_workq, &ctx->relay_work, K_TIMEOUT_ABS_TICKS(release_at));
 	} else {
 		LOG_DBG("Holding relay closed");
 	}
 }
 
+static void close_relay(struct relay_svc_context *ctx, uint32_t duration_ms) {
+	actuate_relay(ctx, duration_ms, 0);
+}
+
+/**
+ * Pulse the relay `count` times, e.g. to stop and then reverse a moving entrance.
+ */
+static void pulse_relay(struct relay_svc_context *ctx, uint8_t count) {
+	actuate_relay(ctx, CONFIG_ENTRANCE_RELAY_MOMENTARY_TIME_MS, count - 1);
+}
+
 /**
  * Open the relay. This is mostly used to release the relay if the relay is being held closed.
- * Must not be called from the open relay handler as it cancels the work.
  */
 static void release_relay(struct relay_svc_context *ctx) {
-	/* We don't care that the open relay handler may be running; in either case the
-	 * relay will be released. */
 	LOG_DBG("Releasing relay");
-	k_work_cancel_delayable(&ctx->open_relay_work);
-	gpio_pin_set_dt(ctx->relay, 1);
+
+	k_spinlock_key_t key = k_spin_lock(&ctx->relay_lock);
+
+	gpio_pin_set_dt(ctx->relay, RELAY_OPEN);
+	ctx->release_at = 0;
+	ctx->repulse_at = 0;
+	ctx->extra_pulses = 0;
+#ifdef CONFIG_ENTRANCE_RELAY_PULSE_TIMER
+	counter_cancel_channel_alarm(pulse_timer, ctx->chan);
+#endif
+	k_spin_unlock(&ctx->relay_lock, key);
 }
 
-static void open_relay_handler(struct k_work *work) {
-	const struct k_work_delayable *open_relay_work = k_work_delayable_from_work(work);
-	struct relay_svc_context *ctx = CONTAINER_OF(open_relay_work, struct relay_svc_context, open_relay_work);
+static void relay_work_handler(struct k_work *work) {
+	const struct k_work_delayable *relay_work = k_work_delayable_from_work(work);
+	struct relay_svc_context *ctx = CONTAINER_OF(relay_work, struct relay_svc_context, relay_work);
+	k_spinlock_key_t key = k_spin_lock(&ctx->relay_lock);
+	int64_t now = k_uptime_ticks();
+
+	if (ctx->release_at > 0 && now >= ctx->release_at) {
+		end_pulse(ctx, now);
+	} else if (ctx->repulse_at > 0 && now >= ctx->repulse_at) {
+		ctx->repulse_at = 0;
+		start_pulse(ctx, CONFIG_ENTRANCE_RELAY_MOMENTARY_TIME_MS);
+	}
 
-	LOG_DBG("Opening relay");
-	gpio_pin_set_dt(ctx->relay, 0);
+	/* At most one of these is pending */
+	int64_t next = MAX(ctx->release_at, ctx->repulse_at);
+
+	k_spin_unlock(&ctx->relay_lock, key);
+
+	if (next > 0) {
+		k_work_reschedule_for_queue(&relay_workq, &ctx->relay_work, K_TIMEOUT_ABS_TICKS(next));
+	}
 }
 
-static void command_state(struct relay_svc_context *ctx, enum entrance_cmd_t cmd) {
-	k_sem_take(&ctx_sem, K_FOREVER);
+static void start_movement(struct relay_svc_context *ctx, enum entrance_state_t target, int64_t now) {
+	ctx->entr_state = DOOR_STATE_MOVING;
+	ctx->nx_entr_state = target;
+	ctx->entr_transition = now + movement_ticks(ctx, target);
+}
+
+/**
+ * The state a command moves the entrance to. Toggles are resolved against the
+ * position the entrance is at or heading to.
+ */
+static enum entrance_state_t command_target(const struct relay_svc_context *ctx, enum entrance_cmd_t cmd) {
+	enum entrance_state_t cur = ctx->entr_state;
+
+	if (cur == DOOR_STATE_MOVING) {
+		cur = ctx->nx_entr_state;
+	} else if (cur == DOOR_STATE_STOPPED) {
+		cur = ctx->stop_target;
+	}
+
+	switch (cmd) {
+		case DOOR_CMD_TOGGLE:
+			return is_open_state(cur) ? DOOR_STATE_CLOSED :
+				(HAS_AUTO_CLOSE ? DOOR_STATE_MOM_OPEN : DOOR_STATE_HOLD_OPEN);
+		case DOOR_CMD_CLOSE:
+			return DOOR_STATE_CLOSED;
+		case DOOR_CMD_MOM_OPEN:
+			return HAS_AUTO_CLOSE ? DOOR_STATE_MOM_OPEN : DOOR_STATE_HOLD_OPEN;
+		case DOOR_CMD_HOLD_OPEN:
+			return DOOR_STATE_HOLD_OPEN;
+		default:
+			return DOOR_STATE_UNKNOWN;
+	}
+}
+
+/**
+ * Handle a command while the entrance is moving. Stop and reverse act right away if
+ * the opener supports it; anything heading elsewhere waits in the pending slot until
+ * the movement completes.
+ */
+static enum entrance_cmd_result_t command_moving(struct relay_svc_context *ctx, enum entrance_cmd_t cmd,
+						 int64_t now) {
+	enum entrance_state_t target;
+
+	switch (cmd) {
+		case DOOR_CMD_STOP:
+			if (!STOP_ON_PULSE) {
+				return DOOR_CMD_RESULT_IGNORED;
+			}
+			pulse_relay(ctx, 1);
+			ctx->stop_target = ctx->nx_entr_state;
+			ctx->entr_state = DOOR_STATE_STOPPED;
+			ctx->nx_entr_state = DOOR_STATE_STOPPED;
+			ctx->entr_transition = 0;
+			ctx->pending_cmd = 0;
+			k_work_cancel_delayable(&ctx->entr_state_work);
+			return DOOR_CMD_RESULT_APPLIED;
+		case DOOR_CMD_REVERSE:
+			if (!STOP_ON_PULSE) {
+				return DOOR_CMD_RESULT_IGNORED;
+			}
+			/* The first pulse stops the entrance, the second reverses it */
+			pulse_relay(ctx, 2);
+			start_movement(ctx, command_target(ctx, DOOR_CMD_TOGGLE), now);
+			ctx->pending_cmd = 0;
+			return DOOR_CMD_RESULT_APPLIED;
+		default:
+			break;
+	}
+
+	target = command_target(ctx, cmd);
+	if (target == DOOR_STATE_UNKNOWN) {
+		return DOOR_CMD_RESULT_IGNORED;
+	}
+
+	if (target == ctx->nx_entr_state) {
+		/* Already heading there. This also cancels a queued command. */
+		ctx->pending_cmd = 0;
+		return DOOR_CMD_RESULT_APPLIED;
+	}
+
+	if (HAS_AUTO_CLOSE && target == DOOR_STATE_HOLD_OPEN && ctx->nx_entr_state == DOOR_STATE_MOM_OPEN) {
+		/* Keeping the relay closed holds the entrance open once it arrives */
+		close_relay(ctx, 0);
+		ctx->nx_entr_state = DOOR_STATE_HOLD_OPEN;
+		ctx->pending_cmd = 0;
+		return DOOR_CMD_RESULT_APPLIED;
+	}
+
+	/* Replaces any command already waiting */
+	LOG_INF("Queueing command %d until the entrance arrives", cmd);
+	ctx->pending_cmd = cmd;
+	return DOOR_CMD_RESULT_QUEUED;
+}
 
+/**
+ * Apply a command to the entrance state. Must be called with the context locked.
+ */
+static enum entrance_cmd_result_t apply_command(struct relay_svc_context *ctx, enum entrance_cmd_t cmd) {
 	int64_t now = k_uptime_ticks();
+	enum entrance_cmd_result_t result = DOOR_CMD_RESULT_APPLIED;
+	enum entrance_state_t target;
 
 	switch (ctx->entr_state) {
 		case DOOR_STATE_CLOSED:
@@ -100,14 +575,8 @@ static void command_state(struct relay_svc_context *ctx, enum entrance_cmd_t cmd
 				case DOOR_CMD_TOGGLE:
 				case DOOR_CMD_MOM_OPEN:
 					close_relay(ctx, CONFIG_ENTRANCE_RELAY_MOMENTARY_TIME_MS);
-					ctx->entr_state = DOOR_STATE_MOVING;
-					if (HAS_AUTO_CLOSE) {
-						ctx->nx_entr_state = DOOR_STATE_MOM_OPEN;
-					} else {
-						/* With no auto close a momentary press always holds the door open */
-						ctx->nx_entr_state = DOOR_STATE_HOLD_OPEN;
-					}
-					ctx->entr_transition = now + MOVEMENT_TICKS;
+					/* With no auto close a momentary press always holds the door open */
+					start_movement(ctx, command_target(ctx, DOOR_CMD_MOM_OPEN), now);
 					break;
 				case DOOR_CMD_CLOSE:
 					/* Do nothing */
@@ -119,11 +588,10 @@ static void command_state(struct relay_svc_context *ctx, enum entrance_cmd_t cmd
 						/* With no auto close hold open is just a momentary press */
 						close_relay(ctx, CONFIG_ENTRANCE_RELAY_MOMENTARY_TIME_MS);
 					}
-					ctx->entr_state = DOOR_STATE_MOVING;
-					ctx->nx_entr_state = DOOR_STATE_HOLD_OPEN;
-					ctx->entr_transition = now + MOVEMENT_TICKS;
+					start_movement(ctx, DOOR_STATE_HOLD_OPEN, now);
 					break;
 				default:
+					result = DOOR_CMD_RESULT_IGNORED;
 					break;
 			}
 			break;
@@ -132,9 +600,7 @@ static void command_state(struct relay_svc_context *ctx, enum entrance_cmd_t cmd
 				case DOOR_CMD_TOGGLE:
 				case DOOR_CMD_CLOSE:
 					close_relay(ctx, CONFIG_ENTRANCE_RELAY_MOMENTARY_TIME_MS);
-					ctx->entr_state = DOOR_STATE_MOVING;
-					ctx->nx_entr_state = DOOR_STATE_CLOSED;
-					ctx->entr_transition = now + MOVEMENT_TICKS;
+					start_movement(ctx, DOOR_STATE_CLOSED, now);
 					break;
 				case DOOR_CMD_MOM_OPEN:
 					if (HAS_AUTO_CLOSE) {
@@ -148,6 +614,9 @@ static void command_state(struct relay_svc_context *ctx, enum entrance_cmd_t cmd
 				case DOOR_CMD_HOLD_OPEN:
 					/* nothing */
 					break;
+				default:
+					result = DOOR_CMD_RESULT_IGNORED;
+					break;
 			}
 			break;
 		case DOOR_STATE_MOM_OPEN:
@@ -155,9 +624,7 @@ static void command_state(struct relay_svc_context *ctx, enum entrance_cmd_t cmd
 				case DOOR_CMD_CLOSE:
 				case DOOR_CMD_TOGGLE:
 					close_relay(ctx, CONFIG_ENTRANCE_RELAY_MOMENTARY_TIME_MS);
-					ctx->entr_state = DOOR_STATE_MOVING;
-					ctx->nx_entr_state = DOOR_STATE_CLOSED;
-					ctx->entr_transition = now + MOVEMENT_TICKS;
+					start_movement(ctx, DOOR_STATE_CLOSED, now);
 					break;
 				case DOOR_CMD_HOLD_OPEN:
 					if (HAS_AUTO_CLOSE) {
@@ -168,73 +635,156 @@ static void command_state(struct relay_svc_context *ctx, enum entrance_cmd_t cmd
 						ctx->entr_state = DOOR_STATE_HOLD_OPEN;
 						ctx->nx_entr_state = DOOR_STATE_HOLD_OPEN;
 						ctx->entr_transition = 0;
+						k_work_cancel_delayable(&ctx->entr_state_work);
 					}
 					/* Without auto close, both open states are the same */
 					break;
 				case DOOR_CMD_MOM_OPEN:
 					break;
+				default:
+					result = DOOR_CMD_RESULT_IGNORED;
+					break;
+			}
+			break;
+		case DOOR_STATE_STOPPED:
+			if (cmd == DOOR_CMD_STOP) {
+				break;
+			}
+			target = command_target(ctx, (cmd == DOOR_CMD_REVERSE) ? DOOR_CMD_TOGGLE : cmd);
+			if (target == DOOR_STATE_UNKNOWN) {
+				result = DOOR_CMD_RESULT_IGNORED;
+				break;
 			}
+			/* The opener reverses direction after a stop. Continuing in the
+			 * original direction takes a reverse, stop and another reverse.
+			 */
+			pulse_relay(ctx, (is_open_state(target) == is_open_state(ctx->stop_target)) ? 3 : 1);
+			start_movement(ctx, target, now);
+			break;
+		case DOOR_STATE_UNKNOWN:
+			/* The position sensors could not confirm where the entrance is, e.g. it
+			 * stalled between them. Pulse the relay and let the sensors report where
+			 * the entrance ends up.
+			 */
+			target = command_target(ctx, cmd);
+			if (target == DOOR_STATE_UNKNOWN) {
+				result = DOOR_CMD_RESULT_IGNORED;
+				break;
+			}
+			close_relay(ctx, CONFIG_ENTRANCE_RELAY_MOMENTARY_TIME_MS);
+			start_movement(ctx, target, now);
+			break;
 		case DOOR_STATE_MOVING:
-			LOG_WRN("Command received while door is moving! Ignoring for now");
-			/* TODO: handle canceling and resuming movement, etc */
+			result = command_moving(ctx, cmd, now);
 			break;
 		default:
 			LOG_ERR("Invalid entrance state: %d", ctx->entr_state);
-			goto err;
+			return DOOR_CMD_RESULT_IGNORED;
 	}
 
-	LOG_DBG("entrance command %d: state is now %d", cmd, ctx->entr_state);
+	LOG_DBG("entrance command %d: result %d, state is now %d", cmd, result, ctx->entr_state);
 
 	if (ctx->entr_state != ctx->nx_entr_state) {
 		lorawan_services_reschedule_work(&ctx->entr_state_work, K_TIMEOUT_ABS_TICKS(ctx->entr_transition));
 	}
 
-err:
-	k_sem_give(&ctx_sem);
+	ctx->cmd_result = result;
+	return result;
+}
+
+/**
+ * Apply a command and report the outcome. `seq` is the command sequence number, 0 if
+ * unsequenced. `rx_cyc` is the cycle count the command was received at for the latency
+ * stats, or 0 for a local command.
+ */
+static void command_state(struct relay_svc_context *ctx, enum entrance_cmd_t cmd, uint8_t seq,
+			  uint32_t rx_cyc) {
+	int64_t now = k_uptime_get();
+
+	ctx_lock(ctx);
+	ctx->cmd_seq = seq;
+	if (seq != 0 && seq == ctx->last_seq && cmd == ctx->last_cmd &&
+	    now - ctx->last_seq_at < CMD_DEDUP_WINDOW_MS) {
+		LOG_INF("Dropping repeated command %d, seq %d", cmd, seq);
+		ctx->cmd_result = DOOR_CMD_RESULT_DUPLICATE;
+	} else {
+		if (seq != 0) {
+			ctx->last_cmd = cmd;
+			ctx->last_seq = seq;
+			ctx->last_seq_at = now;
+		}
+		ctx->rx_cyc = rx_cyc;
+		apply_command(ctx, cmd);
+		ctx->rx_cyc = 0;
+	}
+	ctx_unlock(ctx);
+
+	/* Report the outcome right away, whether or not the state changed */
+	reset_keepalive(K_NO_WAIT);
 }
 
 static void downlink_info(uint8_t port, uint8_t flags, int16_t rssi, int8_t snr, uint8_t len,
 			  const uint8_t *data, void *context)
 {
 	struct relay_svc_context *ctx = context;
+	/* Never 0, which marks a local command */
+	uint32_t rx_cyc = k_cycle_get_32() | 1;
 
 	LOG_INF("Received from port %d, flags %d, RSSI %ddB, SNR %ddB", port, flags, rssi, snr);
 
-	if (data && len >= sizeof(struct lorawan_entr_downlink_t)) {
-		const struct lorawan_entr_downlink_t *msg = (struct lorawan_entr_downlink_t *)data;
+	if (data && len >= 1) {
+		struct lorawan_entr_downlink_t msg = { .cmd = data[0] };
+
+		if (len >= sizeof(msg)) {
+			msg.seq = data[1];
+		}
 
-		LOG_INF("Entrance command: %d", msg->cmd);
-		command_state(ctx, msg->cmd);
+		LOG_INF("Entrance command: %d, seq %d", msg.cmd, msg.seq);
+		/* This also restarts the keepalive backoff */
+		command_state(ctx, msg.cmd, msg.seq, rx_cyc);
 	}
 }
 
-/* This callback must have a static lifetime */
-static const struct lorawan_downlink_cb downlink_cb[] = {
-	{
-		.port = CONFIG_LORAWAN_PORT_RELAY_BASE+0,
-		.cb = downlink_info,
-		.ctx = &ctx[0],
-	}, {
-		.port = CONFIG_LORAWAN_PORT_RELAY_BASE+1,
-		.cb = downlink_info,
-		.ctx = &ctx[1],
+#define ENTR_DOWNLINK_CB(node)							\
+	[ENTR_IDX(node)] = {							\
+		.port = CONFIG_LORAWAN_PORT_RELAY_BASE + ENTR_IDX(node),	\
+		.cb = downlink_info,						\
+		.ctx = &ctx[ENTR_IDX(node)],					\
 	},
+
+/* These callbacks must have a static lifetime */
+static struct lorawan_downlink_cb downlink_cb[NUM_ENTRANCES] = {
+	ENTR_FOREACH(ENTR_DOWNLINK_CB)
 };
 
 static void entr_state_work_handler(struct k_work *work) {
 	const struct k_work_delayable *entr_state_work = k_work_delayable_from_work(work);
 	struct relay_svc_context *ctx = CONTAINER_OF(entr_state_work, struct relay_svc_context, entr_state_work);
 	uint64_t pending = 0;
-	/* Default is to not create any further transitions */
-	uint8_t nx_state = ctx->nx_entr_state;;
 
-	k_sem_take(&ctx_sem, K_FOREVER);
+	ctx_lock(ctx);
 	int64_t now = k_uptime_ticks();
-	/* Process timed state transitions */
 
+	if (ctx->entr_state == DOOR_STATE_MOVING) {
+		/* Arrival, either reported by a sensor or timed. The sensors take
+		 * precedence over the timer.
+		 */
+		enum entrance_state_t arrived = sensor_state(ctx);
+
+		if (arrived != DOOR_STATE_UNKNOWN) {
+			ctx->nx_entr_state = arrived;
+		} else if (has_sensor_for(ctx, ctx->nx_entr_state)) {
+			LOG_ERR("Entrance did not reach state %d in time", ctx->nx_entr_state);
+			ctx->nx_entr_state = DOOR_STATE_UNKNOWN;
+		}
+	}
+
+	/* Default is to not create any further transitions */
+	enum entrance_state_t nx_state = ctx->nx_entr_state;
+
+	/* Process timed state transitions */
 	switch (ctx->nx_entr_state) {
 		case DOOR_STATE_MOVING:
-			pending = now + MOVEMENT_TICKS;
 			/* Where we end up depends on where we started */
 			switch (ctx->entr_state) {
 				case DOOR_STATE_CLOSED:
@@ -247,6 +797,7 @@ static void entr_state_work_handler(struct k_work *work) {
 				default:
 					LOG_WRN("Unexpected movement origin state %d", ctx->entr_state);
 			}
+			pending = now + movement_ticks(ctx, nx_state);
 			break;
 		case DOOR_STATE_MOM_OPEN:
 			if (HAS_AUTO_CLOSE) {
@@ -263,54 +814,235 @@ static void entr_state_work_handler(struct k_work *work) {
 	ctx->entr_transition = pending; // Zero if no new pending transitions
 	if (pending > 0) {
 		ctx->nx_entr_state = nx_state;
+		/* Schedule the pending transition */
+		lorawan_services_reschedule_work(&ctx->entr_state_work, K_TIMEOUT_ABS_TICKS(pending));
 	}
-	k_sem_give(&ctx_sem);
 
 	LOG_DBG("entrance changed to state %d", ctx->entr_state);
 
+	if (ctx->pending_cmd != 0 && ctx->entr_state != DOOR_STATE_MOVING) {
+		enum entrance_cmd_t cmd = ctx->pending_cmd;
+
+		ctx->pending_cmd = 0;
+		if (ctx->entr_state == DOOR_STATE_UNKNOWN) {
+			/* Don't act on a faulted entrance without a fresh command */
+			ctx->cmd_result = DOOR_CMD_RESULT_IGNORED;
+		} else {
+			LOG_INF("Running queued command %d", cmd);
+			apply_command(ctx, cmd);
+		}
+	}
+	ctx_unlock(ctx);
+
 	/* Schedule uplink of updated state */
-	lorawan_services_reschedule_work(&ctx->uplink_work, K_NO_WAIT);
-	/* If there are pending transitions, schedule them */
-	if (pending > 0) {
-		lorawan_services_reschedule_work(&ctx->entr_state_work, K_TIMEOUT_ABS_TICKS(pending));
+	reset_keepalive(K_NO_WAIT);
+}
+
+static void sensor_work_handler(struct k_work *work) {
+	const struct k_work_delayable *sensor_work = k_work_delayable_from_work(work);
+	struct relay_svc_context *ctx = CONTAINER_OF(sensor_work, struct relay_svc_context, sensor_work);
+	bool arrival = false;
+
+	ctx_lock(ctx);
+	int64_t now = k_uptime_ticks();
+	enum entrance_state_t arrived = sensor_state(ctx);
+
+	if (arrived != DOOR_STATE_UNKNOWN) {
+		if (ctx->entr_state != arrived &&
+		    !(is_open_state(ctx->entr_state) && is_open_state(arrived))) {
+			/* Complete the transition now rather than waiting on the timer */
+			ctx->nx_entr_state = arrived;
+			arrival = true;
+		}
+	} else if ((ctx->entr_state == DOOR_STATE_CLOSED && ctx->closed_sensor != NULL) ||
+		   (is_open_state(ctx->entr_state) && ctx->open_sensor != NULL)) {
+		/* The entrance left its position without a command, e.g. it was operated
+		 * locally. Track the movement to the opposite position.
+		 */
+		enum entrance_state_t target = is_open_state(ctx->entr_state) ?
+			DOOR_STATE_CLOSED : open_state(ctx);
+
+		LOG_INF("Entrance moved without command");
+		ctx->entr_state = DOOR_STATE_MOVING;
+		ctx->nx_entr_state = target;
+		ctx->entr_transition = now + movement_ticks(ctx, target);
+		lorawan_services_reschedule_work(&ctx->entr_state_work,
+						 K_TIMEOUT_ABS_TICKS(ctx->entr_transition));
+		reset_keepalive(K_NO_WAIT);
+	}
+	ctx_unlock(ctx);
+
+	if (arrival) {
+		lorawan_services_reschedule_work(&ctx->entr_state_work, K_NO_WAIT);
 	}
 }
 
-static void uplink_work_handler(struct k_work *work) {
-	const struct k_work_delayable *uplink_work = k_work_delayable_from_work(work);
-	struct relay_svc_context *ctx = CONTAINER_OF(uplink_work, struct relay_svc_context, uplink_work);
-	struct lorawan_entr_uplink_t msg = {
-		.state = ctx->entr_state,
-	};
+static void closed_sensor_isr(const struct device *dev, struct gpio_callback *cb, uint32_t pins) {
+	struct relay_svc_context *ctx = CONTAINER_OF(cb, struct relay_svc_context, closed_cb);
+
+	/* Restarting the delay on every edge debounces the switch */
+	lorawan_services_reschedule_work(&ctx->sensor_work, K_MSEC(CONFIG_ENTRANCE_SENSOR_DEBOUNCE_MS));
+}
+
+static void open_sensor_isr(const struct device *dev, struct gpio_callback *cb, uint32_t pins) {
+	struct relay_svc_context *ctx = CONTAINER_OF(cb, struct relay_svc_context, open_cb);
 
-	lorawan_services_schedule_uplink(ctx->port, (uint8_t *)&msg, sizeof(struct lorawan_entr_uplink_t), 500);
+	lorawan_services_reschedule_work(&ctx->sensor_work, K_MSEC(CONFIG_ENTRANCE_SENSOR_DEBOUNCE_MS));
+}
+
+static int init_sensor(const struct gpio_dt_spec *sensor, struct gpio_callback *cb,
+		       gpio_callback_handler_t handler) {
+	int ret;
+
+	if (!gpio_is_ready_dt(sensor)) {
+		LOG_ERR("Sensor device %s is not ready", sensor->port->name);
+		return -ENODEV;
+	}
+
+	ret = gpio_pin_configure_dt(sensor, GPIO_INPUT);
+	if (ret != 0) {
+		LOG_ERR("Failed to configure sensor pin %d: %d", sensor->pin, ret);
+		return ret;
+	}
+
+	ret = gpio_pin_interrupt_configure_dt(sensor, GPIO_INT_EDGE_BOTH);
+	if (ret != 0) {
+		LOG_ERR("Failed to configure sensor interrupt on pin %d: %d", sensor->pin, ret);
+		return ret;
+	}
 
-	/* Reschedule periodic uplink */
-	lorawan_services_reschedule_work(&ctx->uplink_work, K_MSEC(ctx->period));
-	k_sem_give(&ctx_sem);
+	gpio_init_callback(cb, handler, BIT(sensor->pin));
+	return gpio_add_callback_dt(sensor, cb);
+}
+
+/**
+ * Seconds until the next pending transition, saturated to fit the status record.
+ */
+static uint8_t transition_eta(const struct entr_snapshot *snap, int64_t now) {
+	if (snap->transition == 0 || snap->state == snap->nx_state) {
+		return 0;
+	}
+
+	int64_t eta = k_ticks_to_sec_ceil64(MAX(snap->transition - now, 1));
+
+	return (uint8_t)MIN(eta, UINT8_MAX);
+}
+
+static void status_work_handler(struct k_work *work) {
+	uint8_t buf[sizeof(struct lorawan_entr_status_uplink_t) +
+		    NUM_ENTRANCES * sizeof(struct lorawan_entr_status_t)];
+	struct lorawan_entr_status_uplink_t *msg = (struct lorawan_entr_status_uplink_t *)buf;
+
+	msg->seq = status_seq++;
+	msg->base_port = CONFIG_LORAWAN_PORT_RELAY_BASE;
+	msg->count = NUM_ENTRANCES;
+
+	int64_t now = k_uptime_ticks();
+	for (int i=0; i < NUM_ENTRANCES; i++) {
+		struct entr_snapshot snap;
+
+		/* Never waits on a command or transition in progress */
+		read_snapshot(&ctx[i], &snap);
+		msg->entr[i].state = ENTR_STATUS_STATE(snap.state, snap.nx_state);
+		msg->entr[i].eta_s = transition_eta(&snap, now);
+		msg->entr[i].cmd = ENTR_STATUS_CMD(snap.pending_cmd, snap.cmd_result);
+		msg->entr[i].cmd_seq = snap.cmd_seq;
+	}
+
+	uplink_submit(UPLINK_PRIO_STATE, LORAWAN_PORT_ENTR_STATUS, buf, sizeof(buf));
+
+	/* Reschedule periodic uplink, backing off while the state is stable */
+	atomic_val_t period = atomic_get(&status_period);
+
+	lorawan_services_reschedule_work(&status_work, K_SECONDS(period));
+	/* Don't clobber a reset that raced with this uplink */
+	atomic_cas(&status_period, period, MIN(period * 2, KEEPALIVE_MAX_S));
+}
+
+int relay_count(void) {
+	return NUM_ENTRANCES;
+}
+
+int relay_command(uint8_t entrance, enum entrance_cmd_t cmd) {
+	if (entrance >= NUM_ENTRANCES) {
+		return -EINVAL;
+	}
+
+	command_state(&ctx[entrance], cmd, 0, 0);
+	return 0;
+}
+
+enum entrance_cmd_result_t relay_cmd_result(uint8_t entrance) {
+	struct entr_snapshot snap;
+
+	if (entrance >= NUM_ENTRANCES) {
+		return DOOR_CMD_RESULT_NONE;
+	}
+
+	read_snapshot(&ctx[entrance], &snap);
+	return snap.cmd_result;
 }
 
 int lorawan_relay_run(void) {
-	for (int i=0; i < ARRAY_SIZE(relays); i++) {
-		ctx[i].period = 30000;
+	struct k_work_queue_config workq_cfg = {
+		.name = "relay_workq",
+	};
+
+	k_work_queue_start(&relay_workq, relay_workq_stack, K_THREAD_STACK_SIZEOF(relay_workq_stack),
+			   CONFIG_ENTRANCE_RELAY_WORKQ_PRIORITY, &workq_cfg);
+	/* Actuate next to the MAC delivering the commands */
+	cpu_affinity_pin(k_work_queue_thread_get(&relay_workq), CPU_RADIO);
+
+#ifdef CONFIG_STATS
+	stats_init_and_reg(STATS_HDR(relay_stats), STATS_SIZE_INIT_PARMS(relay_stats, STATS_SIZE_32),
+			   STATS_NAME_INIT_PARMS(relay_stats), "relay");
+#endif
+
+#ifdef CONFIG_ENTRANCE_RELAY_PULSE_TIMER
+	if (!device_is_ready(pulse_timer)) {
+		LOG_ERR("Pulse timer %s is not ready", pulse_timer->name);
+	} else {
+		if (counter_get_num_of_channels(pulse_timer) < NUM_ENTRANCES) {
+			LOG_WRN("Pulse timer has too few channels, some pulses are timed by the work queue");
+		}
+		counter_start(pulse_timer);
+	}
+#endif
+
+	for (int i=0; i < NUM_ENTRANCES; i++) {
 		ctx[i].entr_state = DOOR_STATE_CLOSED;
 		ctx[i].nx_entr_state = DOOR_STATE_CLOSED;
 		ctx[i].entr_transition = 0;
-		ctx[i].relay = &relays[i];
-		ctx[i].port = CONFIG_LORAWAN_PORT_RELAY_BASE + i;
+		k_mutex_init(&ctx[i].lock);
+		publish_snapshot(&ctx[i]);
 
 		gpio_pin_configure_dt(&relays[i], GPIO_OUTPUT_LOW);
 		lorawan_register_downlink_callback(&downlink_cb[i]);
 
 		k_work_init_delayable(&ctx[i].entr_state_work, entr_state_work_handler);
-		k_work_init_delayable(&ctx[i].uplink_work, uplink_work_handler);
-		k_work_init_delayable(&ctx[i].open_relay_work, open_relay_handler);
+		k_work_init_delayable(&ctx[i].relay_work, relay_work_handler);
+		k_work_init_delayable(&ctx[i].sensor_work, sensor_work_handler);
 
-		/* Send first uplink immediately */
-		lorawan_services_reschedule_work(&ctx[i].uplink_work, K_NO_WAIT);
+		if (ctx[i].closed_sensor &&
+		    init_sensor(ctx[i].closed_sensor, &ctx[i].closed_cb, closed_sensor_isr) != 0) {
+			ctx[i].closed_sensor = NULL;
+		}
+		if (ctx[i].open_sensor &&
+		    init_sensor(ctx[i].open_sensor, &ctx[i].open_cb, open_sensor_isr) != 0) {
+			ctx[i].open_sensor = NULL;
+		}
+		if (ctx[i].closed_sensor || ctx[i].open_sensor) {
+			/* Pick up the initial position */
+			lorawan_services_reschedule_work(&ctx[i].sensor_work, K_NO_WAIT);
+		}
 	}
-	/* Switch to class C for lower-latency relay response */
-	lorawan_services_class_c_start();
+
+	/* Send first uplink immediately */
+	k_work_init_delayable(&status_work, status_work_handler);
+	reset_keepalive(K_NO_WAIT);
+
+	/* Class C, or class B ping slots, for lower-latency relay response */
+	lora_class_run();
 
         return 0;
 }
\ No newline at end of file
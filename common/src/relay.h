@@ -1,6 +1,22 @@
 #ifndef __RELAY_H__
 #define __RELAY_H__
 
+#include <stdint.h>
+
+#include "app_protocol.h"
+
 int lorawan_relay_run(void);
 
+/** Number of entrances driven by this controller */
+int relay_count(void);
+
+/**
+ * Command an entrance locally, as if the command had been received over LoRaWAN.
+ * Returns -EINVAL if there is no such entrance.
+ */
+int relay_command(uint8_t entrance, enum entrance_cmd_t cmd);
+
+/** Result of the last command on an entrance */
+enum entrance_cmd_result_t relay_cmd_result(uint8_t entrance);
+
 #endif /* __RELAY_H__ */
\ No newline at end of file
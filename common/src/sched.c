@@ -0,0 +1,485 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/dlist.h>
+#include <services/lorawan_services.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "app_protocol.h"
+#include "relay.h"
+#include "sched.h"
+#include "uplink.h"
+
+LOG_MODULE_REGISTER(sched, LOG_LEVEL_DBG);
+
+/* Seconds between the GPS epoch (1980-01-06) and the unix epoch, less the
+ * GPS-UTC leap second offset.
+ */
+#define GPS_UNIX_OFFSET		(315964800 - 18)
+#define SECONDS_PER_DAY		86400
+#define MIN_PER_DAY		(24 * 60)
+/* 1970-01-01 was a Thursday */
+#define EPOCH_WEEKDAY		4
+
+#define NUM_RULES		CONFIG_ENTRANCE_SCHED_MAX_RULES
+#define SCHED_TICK_S		CONFIG_ENTRANCE_SCHED_TICK
+/* Retry period while waiting for the clock sync */
+#define CLOCK_RETRY		K_SECONDS(30)
+
+/* Timer wheel of schedule ticks. An entry sits in the slot of its expiry
+ * tick modulo the wheel size, so entries more than one revolution out are
+ * passed over until their tick comes around.
+ */
+#define WHEEL_SLOTS		64
+
+struct sched_entry {
+	sys_dnode_t node;
+	uint64_t expiry;	/*< Wheel tick when the entry next fires */
+	uint64_t start_s;	/*< Unix time the current hold window starts */
+	uint64_t end_s;		/*< Unix time the current hold window ends */
+	uint8_t entrance;
+	uint8_t slot;		/*< Rule slot, or SCHED_SLOT_HOLD */
+	bool holding;		/*< Inside the hold window, waiting for the end */
+};
+
+static sys_dlist_t wheel[WHEEL_SLOTS];
+/* Next tick to process, 0 until the clock is first synchronized */
+static uint64_t wheel_now;
+static int armed;
+
+/* Index NUM_RULES is the one-shot hold */
+static struct sched_entry entries[NUM_RULES + 1];
+static struct lorawan_entr_rule_downlink_t rules[NUM_RULES];
+static struct lorawan_entr_sched_downlink_t hold;
+
+static struct k_work_delayable tick_work;
+/* Serializes the downlink callbacks (MAC thread) and the tick work */
+static K_MUTEX_DEFINE(sched_mutex);
+
+static int now_unix(uint64_t *now) {
+	uint32_t gps;
+	int ret = lorawan_clock_sync_get(&gps);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	*now = (uint64_t)gps + GPS_UNIX_OFFSET;
+	return 0;
+}
+
+static inline bool hold_valid(void) {
+	return hold.hold_start != 0 && hold.hold_duration_s != 0;
+}
+
+static void wheel_insert(struct sched_entry *e) {
+	uint64_t t = e->holding ? e->end_s : e->start_s;
+
+	/* Anything already due fires on the next tick */
+	e->expiry = MAX(DIV_ROUND_UP(t, SCHED_TICK_S), wheel_now);
+	sys_dlist_append(&wheel[e->expiry % WHEEL_SLOTS], &e->node);
+	armed++;
+}
+
+/* Earliest expiry of the armed entries, only valid while armed > 0 */
+static uint64_t wheel_next(void) {
+	uint64_t next = UINT64_MAX;
+
+	for (int i = 0; i < ARRAY_SIZE(entries); i++) {
+		if (sys_dnode_is_linked(&entries[i].node)) {
+			next = MIN(next, entries[i].expiry);
+		}
+	}
+
+	return next;
+}
+
+/* Anything stored that needs the clock to be armed */
+static bool sched_pending(void) {
+	if (hold_valid()) {
+		return true;
+	}
+
+	for (int i = 0; i < NUM_RULES; i++) {
+		if (rules[i].days != 0 && rules[i].duration_min != 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void wheel_remove(struct sched_entry *e) {
+	if (sys_dnode_is_linked(&e->node)) {
+		sys_dlist_remove(&e->node);
+		armed--;
+	}
+}
+
+/* Close the entrance at the end of a hold, unless another window still holds it */
+static void release_hold(struct sched_entry *e) {
+	e->holding = false;
+
+	for (int i = 0; i < ARRAY_SIZE(entries); i++) {
+		if (entries[i].holding && entries[i].entrance == e->entrance) {
+			return;
+		}
+	}
+
+	LOG_INF("Hold on entrance %d ended", e->entrance);
+	relay_command(e->entrance, DOOR_CMD_CLOSE);
+}
+
+/* Find the next window of a daily rule that has not ended yet */
+static bool rule_window(const struct lorawan_entr_rule_downlink_t *rule, uint64_t now,
+			uint64_t *start, uint64_t *end) {
+	uint64_t day = now / SECONDS_PER_DAY;
+
+	/* Day -1 covers windows that started yesterday and run past midnight */
+	for (int d = -1; d <= 7; d++) {
+		uint8_t wday = (day + d + EPOCH_WEEKDAY) % 7;
+
+		if (!(rule->days & BIT(wday))) {
+			continue;
+		}
+
+		*start = (day + d) * SECONDS_PER_DAY + rule->start_min * 60;
+		*end = *start + rule->duration_min * 60;
+		if (*end > now) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void arm_entry(struct sched_entry *e, uint64_t now) {
+	wheel_remove(e);
+
+	if (e->slot == SCHED_SLOT_HOLD) {
+		if (!hold_valid()) {
+			return;
+		}
+		e->entrance = hold.entrance;
+		e->start_s = hold.hold_start;
+		e->end_s = hold.hold_start + hold.hold_duration_s;
+		if (e->end_s <= now) {
+			return;
+		}
+	} else {
+		const struct lorawan_entr_rule_downlink_t *rule = &rules[e->slot];
+
+		if (rule->days == 0 || rule->duration_min == 0) {
+			return;
+		}
+		e->entrance = rule->entrance;
+		if (!rule_window(rule, now, &e->start_s, &e->end_s)) {
+			return;
+		}
+	}
+
+	wheel_insert(e);
+}
+
+static void disarm_entry(struct sched_entry *e) {
+	wheel_remove(e);
+	if (e->holding) {
+		release_hold(e);
+	}
+}
+
+static void clear_hold(void) {
+	memset(&hold, 0, sizeof(hold));
+	settings_delete("sched/hold");
+}
+
+static void fire_entry(struct sched_entry *e, uint64_t now) {
+	if (!e->holding) {
+		/* Skip windows that were missed entirely, e.g. while the clock was lost */
+		if (now < e->end_s) {
+			LOG_INF("Holding entrance %d open for %llus", e->entrance, e->end_s - now);
+			e->holding = true;
+			relay_command(e->entrance, DOOR_CMD_HOLD_OPEN);
+			wheel_insert(e);
+			return;
+		}
+	} else {
+		release_hold(e);
+	}
+
+	if (e->slot == SCHED_SLOT_HOLD) {
+		clear_hold();
+	} else {
+		arm_entry(e, now);
+	}
+}
+
+static void tick_work_handler(struct k_work *work) {
+	sys_dlist_t fired;
+	struct sched_entry *e, *tmp;
+	uint64_t now, now_tick;
+
+	k_mutex_lock(&sched_mutex, K_FOREVER);
+
+	if (now_unix(&now) < 0) {
+		/* A new hold or rule restarts the tick */
+		if (sched_pending()) {
+			LOG_DBG("Waiting for clock sync");
+			lorawan_services_reschedule_work(&tick_work, CLOCK_RETRY);
+		}
+		goto out;
+	}
+
+	now_tick = now / SCHED_TICK_S;
+	if (wheel_now == 0) {
+		/* First time with a valid clock, arm whatever was stored or received */
+		wheel_now = now_tick;
+		for (int i = 0; i < ARRAY_SIZE(entries); i++) {
+			arm_entry(&entries[i], now);
+		}
+	}
+
+	/* Catch up on every tick since the last run, but a single revolution
+	 * visits every slot.
+	 */
+	sys_dlist_init(&fired);
+	if (now_tick >= wheel_now) {
+		uint64_t steps = MIN(now_tick - wheel_now + 1, WHEEL_SLOTS);
+
+		for (uint64_t i = 0; i < steps; i++) {
+			sys_dlist_t *slot = &wheel[(wheel_now + i) % WHEEL_SLOTS];
+
+			SYS_DLIST_FOR_EACH_CONTAINER_SAFE(slot, e, tmp, node) {
+				if (e->expiry <= now_tick) {
+					sys_dlist_remove(&e->node);
+					sys_dlist_append(&fired, &e->node);
+					armed--;
+				}
+			}
+		}
+		wheel_now = now_tick + 1;
+	}
+
+	/* Fire after advancing, so re-armed entries land in future slots */
+	SYS_DLIST_FOR_EACH_CONTAINER_SAFE(&fired, e, tmp, node) {
+		sys_dlist_remove(&e->node);
+		fire_entry(e, now);
+	}
+
+	/* Sleep until the next expiry, or stop when there is nothing to wait
+	 * for. The catch up above covers however many ticks were skipped.
+	 */
+	if (armed > 0) {
+		uint64_t next_s = wheel_next() * SCHED_TICK_S;
+
+		lorawan_services_reschedule_work(&tick_work,
+						 K_SECONDS(next_s > now ? next_s - now : 0));
+	}
+
+out:
+	k_mutex_unlock(&sched_mutex);
+}
+
+static void send_confirm(uint8_t port, struct sched_entry *e, int status) {
+	struct lorawan_entr_sched_uplink_t msg = {
+		.slot = e->slot,
+		.status = status,
+		.next_start_s = 0,
+	};
+	uint64_t now;
+
+	if (status == 0 && sys_dnode_is_linked(&e->node) && !e->holding &&
+	    now_unix(&now) == 0 && e->start_s > now) {
+		msg.next_start_s = MIN(e->start_s - now, UINT32_MAX);
+	}
+
+	uplink_submit(UPLINK_PRIO_STATE, port, (uint8_t *)&msg, sizeof(msg));
+}
+
+/* Arm an entry straight away if the clock is known, otherwise leave it to
+ * the first tick after the clock sync.
+ */
+static void rearm(struct sched_entry *e) {
+	uint64_t now;
+
+	if (wheel_now != 0 && now_unix(&now) == 0) {
+		arm_entry(e, now);
+	}
+	lorawan_services_reschedule_work(&tick_work, K_NO_WAIT);
+}
+
+static void hold_downlink(uint8_t port, uint8_t flags, int16_t rssi, int8_t snr, uint8_t len,
+			  const uint8_t *data, void *context)
+{
+	struct sched_entry *e = &entries[NUM_RULES];
+	struct lorawan_entr_sched_downlink_t msg;
+	uint64_t now;
+	int ret = 0;
+
+	if (!data || len < sizeof(msg)) {
+		return;
+	}
+	memcpy(&msg, data, sizeof(msg));
+
+	if (msg.entrance >= relay_count()) {
+		LOG_ERR("Invalid entrance %d", msg.entrance);
+		send_confirm(port, e, -EINVAL);
+		return;
+	}
+
+	k_mutex_lock(&sched_mutex, K_FOREVER);
+
+	disarm_entry(e);
+
+	/* A hold that has already ended cancels the pending one */
+	if (msg.hold_start == 0 || msg.hold_duration_s == 0 ||
+	    (now_unix(&now) == 0 && msg.hold_start + msg.hold_duration_s <= now)) {
+		LOG_INF("Hold cancelled");
+		clear_hold();
+	} else {
+		LOG_INF("Hold on entrance %d at %llu for %us", msg.entrance,
+			msg.hold_start, msg.hold_duration_s);
+		hold = msg;
+		ret = settings_save_one("sched/hold", &hold, sizeof(hold));
+		if (ret < 0) {
+			LOG_ERR("Failed to store hold: %d", ret);
+		}
+		rearm(e);
+	}
+
+	send_confirm(port, e, ret);
+	k_mutex_unlock(&sched_mutex);
+}
+
+static void rule_downlink(uint8_t port, uint8_t flags, int16_t rssi, int8_t snr, uint8_t len,
+			  const uint8_t *data, void *context)
+{
+	struct lorawan_entr_rule_downlink_t msg;
+	struct sched_entry *e;
+	char key[sizeof("sched/rule/255")];
+	int ret;
+
+	if (!data || len < sizeof(msg)) {
+		return;
+	}
+	memcpy(&msg, data, sizeof(msg));
+
+	if (msg.slot >= NUM_RULES) {
+		struct sched_entry invalid = { .slot = msg.slot };
+
+		LOG_ERR("Invalid rule slot %d", msg.slot);
+		send_confirm(port, &invalid, -EINVAL);
+		return;
+	}
+
+	e = &entries[msg.slot];
+	/* The window lookback only reaches back one day */
+	if (msg.entrance >= relay_count() || msg.start_min >= MIN_PER_DAY ||
+	    msg.duration_min > MIN_PER_DAY || msg.days & ~0x7f) {
+		LOG_ERR("Invalid rule for slot %d", msg.slot);
+		send_confirm(port, e, -EINVAL);
+		return;
+	}
+
+	snprintf(key, sizeof(key), "sched/rule/%d", msg.slot);
+
+	k_mutex_lock(&sched_mutex, K_FOREVER);
+
+	disarm_entry(e);
+	rules[msg.slot] = msg;
+
+	if (msg.days == 0) {
+		LOG_INF("Rule %d deleted", msg.slot);
+		ret = settings_delete(key);
+	} else {
+		LOG_INF("Rule %d: entrance %d days 0x%02x at %d min for %d min", msg.slot,
+			msg.entrance, msg.days, msg.start_min, msg.duration_min);
+		ret = settings_save_one(key, &msg, sizeof(msg));
+		rearm(e);
+	}
+	if (ret < 0) {
+		LOG_ERR("Failed to store rule %d: %d", msg.slot, ret);
+	}
+
+	send_confirm(port, e, ret);
+	k_mutex_unlock(&sched_mutex);
+}
+
+/* These callbacks must have a static lifetime */
+static struct lorawan_downlink_cb downlink_cb[] = {
+	{
+		.port = LORAWAN_PORT_GATE_SCHED,
+		.cb = hold_downlink,
+	}, {
+		.port = LORAWAN_PORT_GATE_RULES,
+		.cb = rule_downlink,
+	},
+};
+
+static int sched_settings_set(const char *name, size_t len, settings_read_cb read_cb,
+			      void *cb_arg)
+{
+	const char *next;
+	ssize_t ret;
+
+	if (settings_name_steq(name, "hold", &next) && !next) {
+		if (len != sizeof(hold)) {
+			return -EINVAL;
+		}
+		ret = read_cb(cb_arg, &hold, sizeof(hold));
+		return ret < 0 ? ret : 0;
+	}
+
+	if (settings_name_steq(name, "rule", &next) && next) {
+		struct lorawan_entr_rule_downlink_t rule;
+		unsigned long slot = strtoul(next, NULL, 10);
+
+		if (len != sizeof(rule)) {
+			return -EINVAL;
+		}
+		ret = read_cb(cb_arg, &rule, sizeof(rule));
+		if (ret < 0) {
+			return ret;
+		}
+		if (slot < NUM_RULES && rule.slot == slot && rule.start_min < MIN_PER_DAY &&
+		    rule.duration_min <= MIN_PER_DAY) {
+			rules[slot] = rule;
+		}
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(sched, "sched", NULL, sched_settings_set, NULL, NULL);
+
+int lorawan_sched_run(void) {
+	int ret;
+
+	for (int i = 0; i < ARRAY_SIZE(wheel); i++) {
+		sys_dlist_init(&wheel[i]);
+	}
+	for (int i = 0; i < ARRAY_SIZE(entries); i++) {
+		sys_dnode_init(&entries[i].node);
+		entries[i].slot = i < NUM_RULES ? i : SCHED_SLOT_HOLD;
+	}
+
+	ret = settings_load_subtree("sched");
+	if (ret < 0) {
+		LOG_ERR("Failed to load schedule: %d", ret);
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(downlink_cb); i++) {
+		lorawan_register_downlink_callback(&downlink_cb[i]);
+	}
+
+	/* Arming needs the time of day, which the first tick waits for */
+	k_work_init_delayable(&tick_work, tick_work_handler);
+	lorawan_services_reschedule_work(&tick_work, K_NO_WAIT);
+
+	return 0;
+}
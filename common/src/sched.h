@@ -0,0 +1,16 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#ifdef CONFIG_ENTRANCE_SCHED
+/**
+ * Load the stored daily rules and start listening for schedule downlinks.
+ * Requires the relay service to be running.
+ */
+int lorawan_sched_run(void);
+#else
+static inline int lorawan_sched_run(void) {
+	return 0;
+}
+#endif
+
+#endif /* __SCHED_H__ */
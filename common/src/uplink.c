@@ -0,0 +1,252 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/stats/stats.h>
+#include <zephyr/sys/slist.h>
+#include <services/lorawan_services.h>
+
+#include <string.h>
+
+#include "uplink.h"
+#include "../lorawan/airtime.h"
+
+LOG_MODULE_REGISTER(uplink, LOG_LEVEL_INF);
+
+#define BUDGET_MS	CONFIG_LORAWAN_UPLINK_AIRTIME_BUDGET_MS
+#define BUDGET_US	((int64_t)BUDGET_MS * USEC_PER_MSEC)
+#define HOUR_S		(SEC_PER_MIN * MIN_PER_HOUR)
+/* An uplink the services don't take is retried, backing off from RETRY_MS */
+#define RETRY_MS	MSEC_PER_SEC
+#define MAX_ATTEMPTS	5
+
+struct uplink_msg {
+	sys_snode_t node;
+	uint8_t port;
+	uint8_t len;
+	uint8_t attempts;
+	uint8_t data[CONFIG_LORAWAN_SERVICES_MAX_UPLINK_SIZE];
+};
+
+/*
+ * Share of the budget a class has to leave for the classes above it. State
+ * uplinks are never held back, but their airtime still counts.
+ */
+static const uint8_t reserve_pct[UPLINK_PRIO_COUNT] = {
+	[UPLINK_PRIO_STATE] = 0,
+	[UPLINK_PRIO_FUOTA] = 0,
+	[UPLINK_PRIO_TELEMETRY] = 25,
+	[UPLINK_PRIO_DIAG] = 50,
+};
+
+K_MEM_SLAB_DEFINE_STATIC(msg_slab, sizeof(struct uplink_msg), CONFIG_LORAWAN_UPLINK_QUEUE_SIZE, 4);
+static sys_slist_t queue[UPLINK_PRIO_COUNT];
+static int depth[UPLINK_PRIO_COUNT];
+static K_MUTEX_DEFINE(uplink_lock);
+
+/* Airtime left, refilled continuously at the hourly budget */
+static int64_t tokens_us = BUDGET_US;
+static int64_t refilled_at;
+/* Nothing is handed over before the previous uplink's RX windows closed */
+static int64_t next_tx_at;
+
+static void tx_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(tx_work, tx_work_handler);
+
+STATS_SECT_START(uplink_stats)
+STATS_SECT_ENTRY32(depth_state)
+STATS_SECT_ENTRY32(depth_fuota)
+STATS_SECT_ENTRY32(depth_telemetry)
+STATS_SECT_ENTRY32(depth_diag)
+STATS_SECT_ENTRY32(sent)
+STATS_SECT_ENTRY32(dropped)
+STATS_SECT_ENTRY32(deferred)
+STATS_SECT_ENTRY32(airtime_ms)
+STATS_SECT_ENTRY32(budget_used_ms)
+STATS_SECT_END;
+
+STATS_NAME_START(uplink_stats)
+STATS_NAME(uplink_stats, depth_state)
+STATS_NAME(uplink_stats, depth_fuota)
+STATS_NAME(uplink_stats, depth_telemetry)
+STATS_NAME(uplink_stats, depth_diag)
+STATS_NAME(uplink_stats, sent)
+STATS_NAME(uplink_stats, dropped)
+STATS_NAME(uplink_stats, deferred)
+STATS_NAME(uplink_stats, airtime_ms)
+STATS_NAME(uplink_stats, budget_used_ms)
+STATS_NAME_END(uplink_stats);
+
+STATS_SECT_DECL(uplink_stats) uplink_stats;
+
+static void refill_locked(int64_t now) {
+	tokens_us = MIN(tokens_us + (now - refilled_at) * BUDGET_MS / HOUR_S, BUDGET_US);
+	refilled_at = now;
+}
+
+static void update_stats_locked(void) {
+	STATS_SET(uplink_stats, depth_state, depth[UPLINK_PRIO_STATE]);
+	STATS_SET(uplink_stats, depth_fuota, depth[UPLINK_PRIO_FUOTA]);
+	STATS_SET(uplink_stats, depth_telemetry, depth[UPLINK_PRIO_TELEMETRY]);
+	STATS_SET(uplink_stats, depth_diag, depth[UPLINK_PRIO_DIAG]);
+	STATS_SET(uplink_stats, budget_used_ms, (BUDGET_US - tokens_us) / USEC_PER_MSEC);
+}
+
+static void dequeue_locked(enum uplink_prio prio) {
+	struct uplink_msg *msg = CONTAINER_OF(sys_slist_get(&queue[prio]), struct uplink_msg, node);
+
+	depth[prio]--;
+	k_mem_slab_free(&msg_slab, msg);
+}
+
+/* Drop the oldest uplink of the least important class below `prio` */
+static int evict_locked(enum uplink_prio prio) {
+	for (int p = UPLINK_PRIO_COUNT - 1; p > prio; p--) {
+		if (!sys_slist_is_empty(&queue[p])) {
+			LOG_WRN("Queue full, dropping class %d uplink", p);
+			dequeue_locked(p);
+			STATS_INC(uplink_stats, dropped);
+			return 0;
+		}
+	}
+
+	return -ENOSPC;
+}
+
+static void tx_work_handler(struct k_work *work) {
+	struct uplink_msg *msg = NULL;
+	int64_t now = k_uptime_get();
+	int64_t delay = 0;
+	uint32_t airtime_us;
+	int prio;
+	int ret;
+
+	k_mutex_lock(&uplink_lock, K_FOREVER);
+	refill_locked(now);
+
+	for (prio = 0; prio < UPLINK_PRIO_COUNT; prio++) {
+		if (!sys_slist_is_empty(&queue[prio])) {
+			msg = CONTAINER_OF(sys_slist_peek_head(&queue[prio]), struct uplink_msg, node);
+			break;
+		}
+	}
+
+	if (msg == NULL) {
+		goto out;
+	}
+
+	airtime_us = lorawan_airtime_us(msg->len);
+
+	if (prio != UPLINK_PRIO_STATE) {
+		int64_t needed_us = airtime_us + BUDGET_US * reserve_pct[prio] / 100;
+
+		if (tokens_us < needed_us) {
+			/* Less important classes need even more, wait for the refill */
+			delay = DIV_ROUND_UP((needed_us - tokens_us) * HOUR_S, BUDGET_MS);
+			LOG_DBG("Airtime budget exhausted, class %d waits %lld ms", prio, delay);
+			STATS_INC(uplink_stats, deferred);
+			goto out;
+		}
+	}
+
+	ret = lorawan_services_schedule_uplink(msg->port, msg->data, msg->len, 500);
+	if (ret < 0) {
+		if (++msg->attempts < MAX_ATTEMPTS) {
+			/* Stays at the head of its class, the services queue may drain */
+			delay = RETRY_MS << (msg->attempts - 1);
+			LOG_WRN("Failed to schedule uplink on port %d: %d, retrying in %lld ms",
+				msg->port, ret, delay);
+			goto out;
+		}
+		LOG_ERR("Failed to schedule uplink on port %d: %d, dropping", msg->port, ret);
+		STATS_INC(uplink_stats, dropped);
+		dequeue_locked(prio);
+		delay = RETRY_MS;
+		goto out;
+	}
+
+	tokens_us -= airtime_us;
+	STATS_INC(uplink_stats, sent);
+	STATS_INCN(uplink_stats, airtime_ms, airtime_us / USEC_PER_MSEC);
+	dequeue_locked(prio);
+
+	next_tx_at = now + airtime_us / USEC_PER_MSEC + CONFIG_LORAWAN_UPLINK_SPACING_MS;
+	delay = next_tx_at - now;
+
+out:
+	update_stats_locked();
+	if (delay > 0) {
+		lorawan_services_reschedule_work(&tx_work, K_MSEC(delay));
+	}
+	k_mutex_unlock(&uplink_lock);
+}
+
+int uplink_submit(enum uplink_prio prio, uint8_t port, const uint8_t *data, size_t len) {
+	struct uplink_msg *msg;
+	int ret;
+
+	if (prio >= UPLINK_PRIO_COUNT || len > sizeof(msg->data)) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&uplink_lock, K_FOREVER);
+
+	if (k_mem_slab_alloc(&msg_slab, (void **)&msg, K_NO_WAIT) != 0) {
+		ret = evict_locked(prio);
+		if (ret < 0) {
+			LOG_ERR("Queue full, dropping uplink on port %d", port);
+			STATS_INC(uplink_stats, dropped);
+			k_mutex_unlock(&uplink_lock);
+			return ret;
+		}
+		k_mem_slab_alloc(&msg_slab, (void **)&msg, K_NO_WAIT);
+	}
+
+	msg->port = port;
+	msg->len = len;
+	msg->attempts = 0;
+	memcpy(msg->data, data, len);
+	sys_slist_append(&queue[prio], &msg->node);
+	depth[prio]++;
+	update_stats_locked();
+
+	/* Jumps ahead of anything waiting for the budget, but not the spacing */
+	lorawan_services_reschedule_work(&tx_work, K_MSEC(MAX(next_tx_at - k_uptime_get(), 0)));
+
+	k_mutex_unlock(&uplink_lock);
+
+	return 0;
+}
+
+int uplink_queue_depth(enum uplink_prio prio) {
+	int ret;
+
+	k_mutex_lock(&uplink_lock, K_FOREVER);
+	ret = depth[prio];
+	k_mutex_unlock(&uplink_lock);
+
+	return ret;
+}
+
+uint32_t uplink_budget_used_ms(void) {
+	int64_t used_us;
+
+	k_mutex_lock(&uplink_lock, K_FOREVER);
+	refill_locked(k_uptime_get());
+	used_us = BUDGET_US - tokens_us;
+	k_mutex_unlock(&uplink_lock);
+
+	return used_us / USEC_PER_MSEC;
+}
+
+static int uplink_init(void) {
+	for (int i = 0; i < UPLINK_PRIO_COUNT; i++) {
+		sys_slist_init(&queue[i]);
+	}
+
+	stats_init_and_reg(STATS_HDR(uplink_stats), STATS_SIZE_INIT_PARMS(uplink_stats, STATS_SIZE_32),
+			   STATS_NAME_INIT_PARMS(uplink_stats), "uplink");
+
+	return 0;
+}
+
+SYS_INIT(uplink_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
@@ -0,0 +1,36 @@
+#ifndef __UPLINK_H__
+#define __UPLINK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Uplink classes, most important first */
+enum uplink_prio {
+	/** Entrance state, schedule confirmations and peer events */
+	UPLINK_PRIO_STATE,
+	UPLINK_PRIO_FUOTA,
+	UPLINK_PRIO_TELEMETRY,
+	UPLINK_PRIO_DIAG,
+	UPLINK_PRIO_COUNT,
+};
+
+/**
+ * Queue an uplink. Queued uplinks are handed to the LoRaWAN services one at
+ * a time, most important class first, as the hourly airtime budget allows.
+ * When the queue is full the oldest uplink of a less important class is
+ * dropped to make room. An uplink the services don't accept is retried a few
+ * times, backing off, before it is dropped.
+ *
+ * Queue depths and budget usage are reported in the "uplink" stats group.
+ *
+ * @return 0, or -ENOSPC if nothing less important could be dropped
+ */
+int uplink_submit(enum uplink_prio prio, uint8_t port, const uint8_t *data, size_t len);
+
+/** Number of uplinks queued in a class */
+int uplink_queue_depth(enum uplink_prio prio);
+
+/** Airtime used from the hourly budget, in ms */
+uint32_t uplink_budget_used_ms(void);
+
+#endif /* __UPLINK_H__ */
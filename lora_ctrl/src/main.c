@@ -15,12 +15,17 @@
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/usb/usb_device.h>
 #include <zephyr/pm/policy.h>
+#include <zephyr/settings/settings.h>
+#include <string.h>
 #include "app_protocol.h"
 #include "adc.h"
 #include "fuota.h"
 #include "pwm.h"
 #include "buttons.h"
 #include "pm.h"
+#ifdef CONFIG_LORA_PEER_AUTH
+#include "../lorawan/peer_auth.h"
+#endif
 
 LOG_MODULE_REGISTER(main, LOG_LEVEL_INF);
 
@@ -55,6 +60,42 @@ static const struct lora_modem_config lora_rx_cfg = {
 	.iq_inverted = true, // Seems to be set by default for downlinks
 };
 
+#ifdef CONFIG_LORA_PEER_AUTH
+/* Controllers in class C listen on the downlink channel */
+static const struct lora_modem_config lora_peer_cfg = {
+	.frequency = 923300000,
+	.bandwidth = BW_500_KHZ,
+	.datarate = SF_12,
+	.coding_rate = CR_4_5,
+	.public_network = 1,
+	.preamble_len = 8,
+	.iq_inverted = true,
+	.tx_power = 20,
+	.tx = true,
+};
+
+/* Frame counter, persisted so frames are never replayable after a reset */
+static uint32_t peer_counter;
+
+static int peer_settings_set(const char *name, size_t len, settings_read_cb read_cb,
+			     void *cb_arg)
+{
+	ssize_t ret;
+
+	if (strcmp(name, "ctr") != 0) {
+		return -ENOENT;
+	}
+	if (len != sizeof(peer_counter)) {
+		return -EINVAL;
+	}
+
+	ret = read_cb(cb_arg, &peer_counter, sizeof(peer_counter));
+	return ret < 0 ? ret : 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(peer, "peer", NULL, peer_settings_set, NULL, NULL);
+#endif
+
 int lora_init(void) {
 	if (!device_is_ready(lora_dev)) {
 		LOG_ERR("%s: device not ready.", lora_dev->name);
@@ -140,9 +181,14 @@ static int button_action(uint8_t i, uint8_t action) {
 	int8_t snr;
 
 	/* Set MHDR to proprietary, LoRa major version 1 */
+#ifdef CONFIG_LORA_PEER_AUTH
+	struct lora_remote_auth_uplink_t uplink;
+	uplink.hdr.type = LORA_PROP_TYPE_REMOTE_AUTH;
+#else
 	struct lora_remote_uplink_t uplink;
-	uplink.hdr.mhdr = LORA_MHDR_PROPRIETARY;
 	uplink.hdr.type = LORA_PROP_TYPE_REMOTE;
+#endif
+	uplink.hdr.mhdr = LORA_MHDR_PROPRIETARY;
 
 	uplink.hdr.battery_lvl = adc_read_battery();
 	render_battery_lvl(uplink.hdr.battery_lvl);
@@ -154,6 +200,27 @@ static int button_action(uint8_t i, uint8_t action) {
 
 	uplink.btn = i;
 	uplink.action = action;
+
+#ifdef CONFIG_LORA_PEER_AUTH
+	uplink.counter = ++peer_counter;
+	ret = settings_save_one("peer/ctr", &peer_counter, sizeof(peer_counter));
+	if (ret < 0) {
+		LOG_ERR("Failed to store counter: %d", ret);
+	}
+	lora_peer_mic((uint8_t *)&uplink, offsetof(struct lora_remote_auth_uplink_t, mic), uplink.mic);
+
+	/* Controllers in range act on this copy straight away. The server is
+	 * told about the press through the gateway below either way.
+	 */
+	ret = lora_config(lora_dev, &lora_peer_cfg);
+	if (ret == 0) {
+		ret = lora_send(lora_dev, (uint8_t *)&uplink, sizeof(uplink));
+	}
+	if (ret < 0) {
+		LOG_ERR("Failed to transmit to controllers: %d", ret);
+	}
+#endif
+
 	ret = lora_config(lora_dev, &lora_tx_cfg);
 	if (ret < 0) {
 		LOG_ERR("Failed to configure TX: %d", ret);
@@ -214,6 +281,16 @@ int main(void)
 
 	ret = pm_init();
 
+#ifdef CONFIG_LORA_PEER_AUTH
+	ret = settings_subsys_init();
+	if (ret == 0) {
+		ret = settings_load_subtree("peer");
+	}
+	if (ret < 0) {
+		LOG_ERR("Failed to load frame counter: %d", ret);
+	}
+#endif
+
 	ret = adc_init();
 	ret = pwm_init();
 	ret = button_init();
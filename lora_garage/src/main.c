@@ -15,6 +15,8 @@
 
 #include "fuota.h"
 #include "relay.h"
+#include "sched.h"
+#include "peer.h"
 
 LOG_MODULE_REGISTER(main, CONFIG_LORAWAN_SERVICES_LOG_LEVEL);
 
@@ -54,6 +56,8 @@ int main(void)
 	report_version();
 
 	lorawan_relay_run();
+	lorawan_sched_run();
+	lorawan_peer_run();
 
 	while (1) {
 		k_sleep(K_MINUTES(5));
@@ -3,84 +3,499 @@
 #include <zephyr/logging/log.h>
 #include <zephyr/drivers/lora.h>
 #include <zephyr/lorawan/lorawan.h>
+#include <services/lorawan_services.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/atomic.h>
+
+#include <string.h>
 
 #include "app_protocol.h"
 #include "renogy.h"
-#include "relay.h"
+#include "lora_class.h"
+#include "cpu_affinity.h"
+#include "series.h"
+#include "delta.h"
+#include "packer.h"
+#include "uplink.h"
 
 LOG_MODULE_REGISTER(app, CONFIG_LORAWAN_SERVICES_LOG_LEVEL);
 
-uint8_t charger_present;
+#define TELEMETRY_WORKQ_STACK_SIZE	2048
+#define TELEMETRY_WORKQ_PRIORITY	K_PRIO_PREEMPT(CONFIG_MAIN_THREAD_PRIORITY)
+#define REPORT_INTERVAL_MS		(CONFIG_TELEMETRY_REPORT_INTERVAL * MSEC_PER_SEC)
+#define MAX_STALE_MS			(CONFIG_TELEMETRY_MAX_STALE * MSEC_PER_SEC)
+
+BUILD_ASSERT(RENOGY_ENCODED_LEN(REN_SYS_FIELDS) <= CONFIG_LORAWAN_SERVICES_MAX_UPLINK_SIZE &&
+	     RENOGY_ENCODED_LEN(REN_BAT_FIELDS) <= CONFIG_LORAWAN_SERVICES_MAX_UPLINK_SIZE &&
+	     RENOGY_ENCODED_LEN(REN_STATS_FIELDS) <= CONFIG_LORAWAN_SERVICES_MAX_UPLINK_SIZE &&
+	     RENOGY_ENCODED_LEN(REN_BMS_FIELDS) <= CONFIG_LORAWAN_SERVICES_MAX_UPLINK_SIZE,
+	     "Telemetry uplinks don't fit the services uplink buffer");
+
+/*
+ * The Modbus polling blocks for up to the response timeout, so it runs on its
+ * own queue instead of the system or services work queue.
+ */
+static K_THREAD_STACK_DEFINE(telemetry_workq_stack, TELEMETRY_WORKQ_STACK_SIZE);
+static struct k_work_q telemetry_workq;
+
+/**
+ * Last good readings of a device, reported while the next reading is taken
+ */
+struct dev_snapshot {
+	union {
+		struct renogy_dyn_view dyn;
+		struct renogy_bms_view bms;
+	};
+	/** Uptime of the reading, 0 if there is none */
+	int64_t updated_at;
+	/** Whether the configuration of a charger was reported */
+	bool cfg_sent;
+	/** Charger values as last reported */
+	struct delta_state delta;
+};
+
+static struct dev_snapshot snaps[CONFIG_RENOGY_MAX_DEVICES];
+static K_MUTEX_DEFINE(snap_lock);
+static size_t num_devs;
+/** Device reported next */
+static size_t next_dev;
+static bool reporting;
+
+static void detect_work_handler(struct k_work *work);
+static void report_work_handler(struct k_work *work);
+static void sample_work_handler(struct k_work *work);
+static void query_work_handler(struct k_work *work);
+
+static K_WORK_DEFINE(detect_work, detect_work_handler);
+static K_WORK_DELAYABLE_DEFINE(report_work, report_work_handler);
+static K_WORK_DELAYABLE_DEFINE(sample_work, sample_work_handler);
+static K_WORK_DEFINE(query_work, query_work_handler);
+
+/** Groups requested per device, see lorawan_charger_query_group_t */
+static atomic_t query_groups[CONFIG_RENOGY_MAX_DEVICES];
+static struct lorawan_downlink_cb query_cb[CONFIG_RENOGY_MAX_DEVICES];
 
-/* TODO: refactor as periodic lorawan service */
-int charger_xmit_cfg(void) {
+/** Position of a device among the devices of its kind */
+static size_t dev_index(const struct renogy_dev *dev) {
+	size_t n = 0;
+
+	for (size_t i = 0; renogy_dev_get(i) != dev; i++) {
+		if (renogy_dev_get(i)->type == dev->type) {
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * Ports are per kind of device, further devices of the same kind use the
+ * ports of the first offset by LORAWAN_PORT_DEV_STRIDE.
+ */
+static uint8_t dev_port(const struct renogy_dev *dev, uint8_t port) {
+	return port + dev_index(dev) * LORAWAN_PORT_DEV_STRIDE;
+}
+
+static int xmit(const struct renogy_dev *dev, uint8_t port, uint8_t *buf, size_t len) {
 	int ret;
-	uint8_t buf[256];
 
-	if (!charger_present) {
-		return 0;
+#ifdef CONFIG_LORAWAN_UPLINK_PACKER
+	ret = lorawan_pack_uplink(dev_port(dev, port), buf, len);
+#else
+	ret = uplink_submit(UPLINK_PRIO_TELEMETRY, dev_port(dev, port), buf, len);
+#endif
+	if (ret < 0) {
+		LOG_ERR("Failed to schedule uplink: %d", ret);
 	}
 
-	ret = charger_get_system((struct renogy_sys_t *)buf);
+	return ret;
+}
+
+/**
+ * Report the configuration of a charger. A failed read doesn't keep the other
+ * part from being reported, the whole is retried with the next report.
+ */
+static int charger_xmit_cfg(const struct renogy_dev *dev) {
+	int ret, err = 0;
+	size_t len;
+	struct renogy_sys_view sys;
+	struct renogy_bat_view bat;
+	uint8_t buf[MAX(RENOGY_ENCODED_LEN(REN_SYS_FIELDS), RENOGY_ENCODED_LEN(REN_BAT_FIELDS))];
+
+	ret = charger_get_system(dev, &sys);
 	if (ret != 0) {
-		LOG_ERR("Failed to get charger system data");
-		return ret;
+		LOG_ERR("Failed to get charger system data: %d", ret);
+		err = ret;
+	} else {
+		len = renogy_sys_encode(&sys, buf);
+		xmit(dev, LORAWAN_PORT_CHARGER_SYS, buf, len);
+	}
+
+	ret = charger_get_bat_info(dev, &bat);
+	if (ret != 0) {
+		LOG_ERR("Failed to get charger battery data: %d", ret);
+		err = ret;
 	} else {
-		ret = lorawan_send(LORAWAN_PORT_CHARGER_SYS, buf, sizeof(struct renogy_sys_t), LORAWAN_MSG_UNCONFIRMED);
-		if (ret < 0) {
-			LOG_ERR("lorawan_send failure: %d", ret);
-			return ret;
+		len = renogy_bat_encode(&bat, buf);
+		xmit(dev, LORAWAN_PORT_CHARGER_BAT_PARAM, buf, len);
+	}
+
+	return err;
+}
+
+/**
+ * Answer a query with fresh readings, as many of the groups as fit one frame
+ */
+static void charger_xmit_query(const struct renogy_dev *dev, uint8_t groups) {
+	struct lorawan_charger_query_uplink_hdr_t hdr = { 0 };
+	struct renogy_dyn_view dyn;
+	struct renogy_sys_view sys;
+	struct renogy_bat_view bat;
+	uint8_t buf[CONFIG_LORAWAN_SERVICES_MAX_UPLINK_SIZE];
+	uint8_t enc[MAX(RENOGY_ENCODED_LEN(REN_SYS_FIELDS), RENOGY_ENCODED_LEN(REN_BAT_FIELDS))];
+	uint8_t max_next, max;
+	size_t limit, len = sizeof(hdr), enc_len;
+	bool have_dyn = false;
+
+	/* The reply is a single frame, whatever the datarate allows */
+	lorawan_get_payload_sizes(&max_next, &max);
+	limit = MIN(max_next, sizeof(buf));
+
+	if (groups & (QUERY_STATUS | QUERY_STATS | QUERY_DAILY | QUERY_HIST)) {
+		have_dyn = charger_get_dyn(dev, &dyn) == 0;
+	}
+
+	for (int bit = 0; bit < 8; bit++) {
+		uint8_t group = BIT(bit);
+
+		if (!(groups & group)) {
+			continue;
+		}
+
+		switch (group) {
+			case QUERY_SYS:
+				if (charger_get_system(dev, &sys) != 0) {
+					continue;
+				}
+				enc_len = renogy_sys_encode(&sys, enc);
+				break;
+			case QUERY_BAT:
+				if (charger_get_bat_info(dev, &bat) != 0) {
+					continue;
+				}
+				enc_len = renogy_bat_encode(&bat, enc);
+				break;
+			case QUERY_STATUS:
+				if (!have_dyn) {
+					continue;
+				}
+				enc_len = renogy_status_encode(&dyn.status, enc);
+				break;
+			case QUERY_STATS:
+				if (!have_dyn) {
+					continue;
+				}
+				enc_len = renogy_stats_encode(&dyn.stats, enc);
+				break;
+			case QUERY_DAILY:
+				if (!have_dyn) {
+					continue;
+				}
+				enc_len = renogy_daily_encode(&dyn.daily, enc);
+				break;
+			case QUERY_HIST:
+				if (!have_dyn) {
+					continue;
+				}
+				enc_len = renogy_hist_encode(&dyn.hist, enc);
+				break;
+			default:
+				continue;
+		}
+
+		/* A smaller group further on may still fit */
+		if (len + enc_len > limit) {
+			LOG_WRN("Query group 0x%02x doesn't fit the frame", group);
+			continue;
 		}
+		memcpy(&buf[len], enc, enc_len);
+		len += enc_len;
+		hdr.groups |= group;
 	}
 
-	ret = charger_get_bat_info((struct renogy_param_bat_t *)buf);
+	LOG_INF("Answering query for 0x%02x with 0x%02x", groups, hdr.groups);
+	memcpy(buf, &hdr, sizeof(hdr));
+	/* Never packed, the reply is already as dense as it gets */
+	uplink_submit(UPLINK_PRIO_TELEMETRY, dev_port(dev, LORAWAN_PORT_CHARGER_QUERY), buf, len);
+}
+
+/** Report the cached readings of a device, with the lock held */
+static void xmit_snapshot(const struct renogy_dev *dev, struct dev_snapshot *snap) {
+	uint8_t buf[CONFIG_LORAWAN_SERVICES_MAX_UPLINK_SIZE];
+	size_t len;
+
+	if (dev->type == REN_DEV_BMS) {
+		LOG_INF("Transmitting BMS status");
+		len = renogy_bms_encode(&snap->bms, buf);
+		xmit(dev, LORAWAN_PORT_BMS_STATUS, buf, len);
+		return;
+	}
+
+#ifdef CONFIG_TELEMETRY_DELTA
+	int64_t now = k_uptime_get();
+
+	/* Between heartbeats, only what moved is reported */
+	if (snap->delta.valid && now - snap->delta.full_at < CONFIG_TELEMETRY_HEARTBEAT * MSEC_PER_SEC) {
+		len = delta_encode(&snap->delta, &snap->dyn, buf, sizeof(buf));
+		if (len > 0) {
+			LOG_INF("Transmitting charger changes");
+			xmit(dev, LORAWAN_PORT_CHARGER_DELTA, buf, len);
+		}
+		return;
+	}
+	delta_reset(&snap->delta, &snap->dyn, now);
+#endif
+
+	LOG_INF("Transmitting charger status");
+	len = renogy_status_encode(&snap->dyn.status, buf);
+	xmit(dev, LORAWAN_PORT_CHARGER_DYN_STATUS, buf, len);
+	len = renogy_stats_encode(&snap->dyn.stats, buf);
+	xmit(dev, LORAWAN_PORT_CHARGER_STATS, buf, len);
+}
+
+/**
+ * Read a device into a scratch buffer and only replace the snapshot once
+ * the read succeeded, so a failed read leaves the last good one in place.
+ *
+ * @param urgent set when the charge state or faults differ from what was last
+ * reported, may be NULL
+ * @return 0, or the error of the read
+ */
+static int refresh_dev(size_t idx, bool *urgent) {
+	static struct dev_snapshot scratch;
+	const struct renogy_dev *dev = renogy_dev_get(idx);
+	struct dev_snapshot *snap = &snaps[idx];
+	int ret;
+
+	if (dev->type == REN_DEV_BMS) {
+		ret = bms_get_status(dev, &scratch.bms);
+	} else {
+		/* One bus transaction for everything reported */
+		ret = charger_get_dyn(dev, &scratch.dyn);
+	}
 	if (ret != 0) {
-		LOG_ERR("Failed to get charger battery data");
+		LOG_WRN("Failed to read device at %d: %d", dev->addr, ret);
 		return ret;
+	}
+
+	k_mutex_lock(&snap_lock, K_FOREVER);
+	if (dev->type == REN_DEV_BMS) {
+		snap->bms = scratch.bms;
 	} else {
-		ret = lorawan_send(LORAWAN_PORT_CHARGER_BAT_PARAM, buf, sizeof(struct renogy_param_bat_t), LORAWAN_MSG_UNCONFIRMED);
-		if (ret < 0) {
-			LOG_ERR("lorawan_send failure: %d", ret);
-			return ret;
+		snap->dyn = scratch.dyn;
+#ifdef CONFIG_TELEMETRY_DELTA
+		if (urgent != NULL) {
+			*urgent = delta_state_changed(&snap->delta, &snap->dyn);
+		}
+#endif
+		/* Decides whether the receiver can afford class C */
+		if (dev_index(dev) == 0) {
+			lora_class_set_soc(renogy_stats_soc_pct(&snap->dyn.stats));
 		}
 	}
+	snap->updated_at = k_uptime_get();
+	k_mutex_unlock(&snap_lock);
 
 	return 0;
 }
 
-int charger_xmit_cur(void) {
+static void detect_work_handler(struct k_work *work) {
 	int ret;
-	uint8_t buf[256];
 
-	if (!charger_present) {
-		return 0;
+	ret = init_charger();
+	if (ret <= 0) {
+		LOG_ERR("Failed to find charger");
+		return;
 	}
+	num_devs = ret;
 
-	ret = charger_get_state((struct renogy_dyn_status_t *)buf);
-	if (ret != 0) {
-		LOG_ERR("Failed to get charger state");
-		return ret;
-	} else {
-		LOG_INF("Transmitting dyn status");
-		ret = lorawan_send(LORAWAN_PORT_CHARGER_DYN_STATUS, buf, sizeof(struct renogy_dyn_status_t), LORAWAN_MSG_UNCONFIRMED);
-		if (ret < 0) {
-			LOG_ERR("lorawan_send failure: %d", ret);
-			return ret;
+	/* Have readings cached in case the first reports can't read the devices */
+	for (size_t i = 0; i < num_devs; i++) {
+		refresh_dev(i, NULL);
+	}
+}
+
+/**
+ * Read the next device and report the new readings. When the device doesn't
+ * answer, its last good readings are reported instead, until they are older
+ * than the stale limit.
+ */
+static void report_work_handler(struct k_work *work) {
+	const struct renogy_dev *dev;
+	struct dev_snapshot *snap;
+
+	if (num_devs == 0) {
+		return;
+	}
+
+	dev = renogy_dev_get(next_dev);
+	snap = &snaps[next_dev];
+
+	refresh_dev(next_dev, NULL);
+
+	k_mutex_lock(&snap_lock, K_FOREVER);
+	if (snap->updated_at != 0 && k_uptime_get() - snap->updated_at <= MAX_STALE_MS) {
+		xmit_snapshot(dev, snap);
+	} else if (snap->updated_at != 0) {
+		LOG_WRN("Readings of device at %d are stale", dev->addr);
+	}
+	k_mutex_unlock(&snap_lock);
+
+	if (dev->type == REN_DEV_CHARGER && !snap->cfg_sent) {
+		snap->cfg_sent = charger_xmit_cfg(dev) == 0;
+	}
+
+	next_dev = (next_dev + 1) % num_devs;
+
+	/* Devices take turns, spread evenly over the report interval */
+	k_work_reschedule_for_queue(&telemetry_workq, &report_work, K_MSEC(REPORT_INTERVAL_MS / num_devs));
+}
+
+/**
+ * Sample the first charger at the fast local rate. The sample goes into the
+ * time series, which is reported once enough windows are closed, and a new
+ * charge state or fault is reported straight away rather than with the next
+ * report.
+ */
+static void sample_work_handler(struct k_work *work) {
+	const struct renogy_dev *dev = NULL;
+	uint8_t buf[CONFIG_LORAWAN_SERVICES_MAX_UPLINK_SIZE];
+	uint8_t max_next, max;
+	size_t idx, len, windows;
+	bool urgent = false;
+	int ret;
+
+	k_work_reschedule_for_queue(&telemetry_workq, &sample_work,
+				    K_SECONDS(CONFIG_TELEMETRY_SAMPLE_INTERVAL));
+
+	for (idx = 0; idx < num_devs; idx++) {
+		if (renogy_dev_get(idx)->type == REN_DEV_CHARGER) {
+			dev = renogy_dev_get(idx);
+			break;
 		}
 	}
+	if (dev == NULL) {
+		return;
+	}
 
-	ret = charger_get_cur_stats((struct renogy_dyn_statistics_t *)buf);
+	/* The whole dynamic block, so the status comes with the stats */
+	ret = refresh_dev(idx, &urgent);
 	if (ret != 0) {
-		LOG_ERR("Failed to get charger stats");
-		return ret;
-	} else {
-		LOG_INF("Transmitting charger stats");
-		ret = lorawan_send(LORAWAN_PORT_CHARGER_STATS, buf, sizeof(struct renogy_dyn_statistics_t), LORAWAN_MSG_UNCONFIRMED);
-		if (ret < 0) {
-			LOG_ERR("lorawan_send failure: %d", ret);
-			return ret;
+		return;
+	}
+
+	k_mutex_lock(&snap_lock, K_FOREVER);
+	if (IS_ENABLED(CONFIG_TELEMETRY_SERIES)) {
+		series_add(&snaps[idx].dyn.stats, k_uptime_get());
+	}
+	if (reporting && urgent) {
+		xmit_snapshot(dev, &snaps[idx]);
+	}
+	k_mutex_unlock(&snap_lock);
+
+	if (IS_ENABLED(CONFIG_TELEMETRY_SERIES) && reporting && series_pending() > 0) {
+		/* One frame at the current datarate, the rest goes with the next one */
+		lorawan_get_payload_sizes(&max_next, &max);
+		len = series_encode(buf, MIN(max_next, sizeof(buf)), &windows);
+		if (len == 0) {
+			LOG_DBG("No series window fits %d bytes", max_next);
+			return;
+		}
+		/* Sent once it holds the windows of an uplink, or no more fit */
+		if (windows < CONFIG_TELEMETRY_SERIES_WINDOWS_PER_UPLINK && windows == series_pending()) {
+			return;
+		}
+		LOG_INF("Transmitting %zu charger series windows", windows);
+		/* Windows of a frame that wasn't accepted are sent again */
+		if (xmit(dev, LORAWAN_PORT_CHARGER_SERIES, buf, len) == 0) {
+			series_drop(windows);
+		}
+	}
+}
+
+static void query_work_handler(struct k_work *work) {
+	for (size_t i = 0; i < num_devs; i++) {
+		uint8_t groups = atomic_clear(&query_groups[i]);
+
+		if (groups != 0) {
+			charger_xmit_query(renogy_dev_get(i), groups);
 		}
 	}
+}
+
+/**
+ * Runs in the MAC context, the bus is only read from the telemetry queue
+ */
+static void query_downlink(uint8_t port, uint8_t flags, int16_t rssi, int8_t snr, uint8_t len,
+			   const uint8_t *data, void *context)
+{
+	struct lorawan_charger_query_downlink_t msg;
+	size_t n = (port - LORAWAN_PORT_CHARGER_QUERY) / LORAWAN_PORT_DEV_STRIDE;
+
+	if (!data || len < sizeof(msg)) {
+		return;
+	}
+	memcpy(&msg, data, sizeof(msg));
+
+	for (size_t i = 0; i < num_devs; i++) {
+		const struct renogy_dev *dev = renogy_dev_get(i);
+
+		if (dev->type == REN_DEV_CHARGER && dev_index(dev) == n) {
+			atomic_or(&query_groups[i], msg.groups);
+			k_work_submit_to_queue(&telemetry_workq, &query_work);
+			return;
+		}
+	}
+
+	LOG_WRN("No charger for query on port %d", port);
+}
+
+int telemetry_init(void) {
+	struct k_work_queue_config workq_cfg = {
+		.name = "telemetry_workq",
+	};
+	int ret;
+
+	/* Before detection starts, as joining initializes settings too */
+	ret = settings_subsys_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to initialize settings: %d", ret);
+		return ret;
+	}
+
+	k_work_queue_start(&telemetry_workq, telemetry_workq_stack,
+			   K_THREAD_STACK_SIZEOF(telemetry_workq_stack), TELEMETRY_WORKQ_PRIORITY,
+			   &workq_cfg);
+	cpu_affinity_pin(k_work_queue_thread_get(&telemetry_workq), CPU_APP);
+
+	k_work_submit_to_queue(&telemetry_workq, &detect_work);
+	if (IS_ENABLED(CONFIG_TELEMETRY_SERIES) || IS_ENABLED(CONFIG_TELEMETRY_DELTA)) {
+		k_work_reschedule_for_queue(&telemetry_workq, &sample_work, K_NO_WAIT);
+	}
+
+	return 0;
+}
+
+int lorawan_telemetry_run(void) {
+	reporting = true;
+
+	for (size_t i = 0; i < ARRAY_SIZE(query_cb); i++) {
+		query_cb[i].port = LORAWAN_PORT_CHARGER_QUERY + i * LORAWAN_PORT_DEV_STRIDE;
+		query_cb[i].cb = query_downlink;
+		lorawan_register_downlink_callback(&query_cb[i]);
+	}
+
+	k_work_reschedule_for_queue(&telemetry_workq, &report_work, K_NO_WAIT);
 
 	return 0;
 }
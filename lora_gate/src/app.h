@@ -3,9 +3,16 @@
 
 #include <stdint.h>
 
-extern uint8_t charger_present;
+/**
+ * Start the telemetry work queue and find the Modbus devices, which can run
+ * while the network is joined.
+ */
+int telemetry_init(void);
 
-int charger_xmit_cfg(void);
-int charger_xmit_cur(void);
+/**
+ * Start reporting the devices in turn, each from its last good readings
+ * while a new reading is taken. The charger configuration is reported once.
+ */
+int lorawan_telemetry_run(void);
 
-#endif /* __APP_H__ */
\ No newline at end of file
+#endif /* __APP_H__ */
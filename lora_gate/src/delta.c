@@ -0,0 +1,80 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <stdlib.h>
+
+#include "app_protocol.h"
+#include "delta.h"
+
+BUILD_ASSERT(DELTA_NUM_FIELDS <= 16, "Presence bitmap is 16 bits");
+
+/* Longest zigzag varint of a field, all of which are at most 32 bits */
+#define MAX_VARINT_LEN	5
+
+#define DELTA_DEADBAND(_blk, _name, _db)	[DELTA_##_blk##_##_name] = (_db),
+#define DELTA_GET(_blk, _name, _db)		val[DELTA_##_blk##_##_name] = renogy_##_blk##_##_name(&dyn->_blk);
+
+static const uint32_t deadband[DELTA_NUM_FIELDS] = {
+	DELTA_FIELDS(DELTA_DEADBAND)
+};
+
+static void get_values(const struct renogy_dyn_view *dyn, int64_t *val) {
+	DELTA_FIELDS(DELTA_GET)
+}
+
+void delta_reset(struct delta_state *state, const struct renogy_dyn_view *dyn, int64_t now) {
+	get_values(dyn, state->sent);
+	state->full_at = now;
+	state->valid = true;
+}
+
+bool delta_state_changed(const struct delta_state *state, const struct renogy_dyn_view *dyn) {
+	return state->valid &&
+	       (renogy_status_charge_state(&dyn->status) != state->sent[DELTA_status_charge_state] ||
+		renogy_status_faults(&dyn->status) != state->sent[DELTA_status_faults]);
+}
+
+static uint8_t *put_zigzag(uint8_t *p, int64_t val) {
+	uint64_t zz = ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+
+	while (zz >= 0x80) {
+		*p++ = (zz & 0x7F) | 0x80;
+		zz >>= 7;
+	}
+	*p++ = zz;
+
+	return p;
+}
+
+size_t delta_encode(struct delta_state *state, const struct renogy_dyn_view *dyn, uint8_t *buf,
+		    size_t size) {
+	struct lorawan_delta_uplink_hdr_t *hdr = (struct lorawan_delta_uplink_hdr_t *)buf;
+	int64_t val[DELTA_NUM_FIELDS];
+	uint8_t *p = buf + sizeof(*hdr);
+	uint16_t present = 0;
+
+	if (size < sizeof(*hdr) + DELTA_NUM_FIELDS * MAX_VARINT_LEN) {
+		return 0;
+	}
+
+	get_values(dyn, val);
+
+	for (int i = 0; i < DELTA_NUM_FIELDS; i++) {
+		/* With a deadband of 0 any change is reported */
+		if (llabs(val[i] - state->sent[i]) <= deadband[i]) {
+			continue;
+		}
+
+		present |= BIT(i);
+		p = put_zigzag(p, val[i]);
+		state->sent[i] = val[i];
+	}
+
+	if (present == 0) {
+		return 0;
+	}
+
+	sys_put_le16(present, (uint8_t *)&hdr->present);
+
+	return p - buf;
+}
@@ -0,0 +1,66 @@
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "renogy.h"
+
+/*
+ * Charger fields reported on change, in frame order, with the deadband a
+ * change has to exceed to be reported. A deadband of 0 reports any change.
+ * See LORAWAN_PORT_CHARGER_DELTA.
+ */
+#define DELTA_FIELDS(F)                         \
+	F(stats, soc_pct,		1)      \
+	F(stats, bat_dV,		1)      \
+	F(stats, charge_cA,		50)     \
+	F(stats, bat_temp_C,		1)      \
+	F(stats, controller_temp_C,	1)      \
+	F(stats, load_dV,		1)      \
+	F(stats, load_cA,		50)     \
+	F(stats, load_W,		5)      \
+	F(stats, solar_dV,		5)      \
+	F(stats, solar_cA,		50)     \
+	F(stats, solar_W,		10)     \
+	F(status, charge_state,		0)      \
+	F(status, load_status,		0)      \
+	F(status, faults,		0)
+
+#define DELTA_ID(_blk, _name, _db)	DELTA_##_blk##_##_name,
+
+enum delta_field {
+	DELTA_FIELDS(DELTA_ID)
+	DELTA_NUM_FIELDS
+};
+
+/**
+ * Values of a charger as last reported
+ */
+struct delta_state {
+	int64_t sent[DELTA_NUM_FIELDS];
+	/** Uptime of the last full report */
+	int64_t full_at;
+	bool valid;
+};
+
+/** Record a full report of all fields */
+void delta_reset(struct delta_state *state, const struct renogy_dyn_view *dyn, int64_t now);
+
+/**
+ * Whether the charge state or the faults differ from what was last reported.
+ * Those are reported as soon as they are read rather than with the next report.
+ */
+bool delta_state_changed(const struct delta_state *state, const struct renogy_dyn_view *dyn);
+
+/**
+ * Encode the fields which moved beyond their deadband since they were last
+ * reported, and record them as reported.
+ *
+ * @return frame length, 0 if nothing moved
+ */
+size_t delta_encode(struct delta_state *state, const struct renogy_dyn_view *dyn, uint8_t *buf,
+		    size_t size);
+
+#endif /* __DELTA_H__ */
@@ -16,7 +16,8 @@
 #include "app.h"
 #include "fuota.h"
 #include "relay.h"
-#include "renogy.h"
+#include "sched.h"
+#include "peer.h"
 
 LOG_MODULE_REGISTER(main, CONFIG_LORAWAN_SERVICES_LOG_LEVEL);
 
@@ -49,17 +50,8 @@ int main(void)
 		goto err;
 	}
 
-	LOG_INF("Looking for charger");
-	k_msleep(500);
-
-	/* TODO: save address in settings */
-	charger_present = 0;
-	ret = init_charger();
-	if (ret == 0) {
-		charger_present = 1;
-	} else {
-		LOG_ERR("Failed to find charger");
-	}
+	/* Find the charger while joining */
+	telemetry_init();
 
 	fuota_run();
 
@@ -68,11 +60,12 @@ int main(void)
 	report_version();
 
 	lorawan_relay_run();
+	lorawan_sched_run();
+	lorawan_peer_run();
 
-	charger_xmit_cfg();
+	lorawan_telemetry_run();
 
 	while (1) {
-		charger_xmit_cur();
 		k_sleep(K_MINUTES(5));
 	}
 
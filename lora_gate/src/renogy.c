@@ -1,6 +1,10 @@
 #include <zephyr/kernel.h>
 #include <zephyr/sys/util.h>
 #include <zephyr/modbus/modbus.h>
+#include <zephyr/settings/settings.h>
+
+#include <stdlib.h>
+#include <string.h>
 
 #include <zephyr/logging/log.h>
 
@@ -9,59 +13,389 @@
 LOG_MODULE_REGISTER(renogy, LOG_LEVEL_INF);
 
 static int client_iface;
-static uint8_t client_addr;
+
+#define MODBUS_BAUD             9600
+/* Start, 8 data and stop bit */
+#define CHAR_US                 (10 * USEC_PER_SEC / MODBUS_BAUD)
+/* Read holding registers request, and its response less the registers */
+#define READ_REQ_CHARS          8
+#define READ_RSP_CHARS          5
+
+#define TURNAROUND_MIN_US       (CONFIG_RENOGY_TURNAROUND_MIN_MS * USEC_PER_MSEC)
+#define TURNAROUND_MAX_US       (CONFIG_RENOGY_TURNAROUND_MAX_MS * USEC_PER_MSEC)
+/* Timeouts are rounded up to this, so small changes don't reconfigure the bus */
+#define TIMEOUT_STEP_US         (5 * USEC_PER_MSEC)
+/* The largest read the poller makes, which every timeout covers */
+#define MAX_READ_WIRE_US        ((READ_REQ_CHARS + READ_RSP_CHARS + \
+                                  sizeof(struct renogy_dyn_view)) * CHAR_US)
+/* Let the transceiver settle after the client is set up, the first request is otherwise lost */
+#define SETTLE_MS               100
+/* Enough doublings to take any allowance to TURNAROUND_MAX_US */
+#define MAX_BACKOFF             8
+/* A single device has its timeout updated this often */
+#define TIMEOUT_REFRESH_MS      (10 * MSEC_PER_SEC * 60)
+
+/**
+ * Link health of a device. The turnaround is the response time less the time
+ * the request and response take on the wire, so reads of any size share it.
+ */
+struct dev_link {
+        uint32_t srtt_us;       /*< Smoothed turnaround, 0 until measured */
+        uint32_t rttvar_us;     /*< Smoothed turnaround deviation */
+        uint8_t backoff;        /*< Doublings of the allowance since the last answer */
+        bool widened;           /*< The timeout grew and the client has to follow */
+        uint8_t failures;       /*< Consecutive failed reads */
+        int64_t open_until;     /*< Uptime the breaker closes again, 0 while closed */
+        struct renogy_link_stats stats;
+};
+
+/* Devices found on the bus, in address order */
+static struct renogy_dev devs[CONFIG_RENOGY_MAX_DEVICES];
+static struct dev_link links[CONFIG_RENOGY_MAX_DEVICES];
+static size_t num_devs;
 
 const static struct modbus_iface_param client_param = {
 	.mode = MODBUS_MODE_RTU,
 	.rx_timeout = 100000,
 	.serial = {
-		.baud = 9600,
+		.baud = MODBUS_BAUD,
 		.parity = UART_CFG_PARITY_NONE,
 		.stop_bits_client = UART_CFG_STOP_BITS_1,
 	},
 };
 
+static uint32_t cur_timeout_us;
+/* Device the timeout was last set for, and when */
+static const struct renogy_dev *timeout_dev;
+static int64_t timeout_set_at;
+
 #define MODBUS_NODE DT_COMPAT_GET_ANY_STATUS_OKAY(zephyr_modbus_serial)
 
-static int find_client(void) {
+/* Valid unicast addresses */
+#define MODBUS_ADDR_MIN         1
+#define MODBUS_ADDR_MAX         247
+
+/**
+ * The client only takes a timeout when it is set up, and is then briefly deaf.
+ * So this is only called for a new device, or for the same one every
+ * TIMEOUT_REFRESH_MS, and only reconfigures the client when the timeout
+ * actually changes.
+ */
+static int set_timeout(uint32_t rx_timeout_us) {
+        struct modbus_iface_param param = client_param;
         int ret;
-        uint16_t buf;
-        uint8_t i=1;
 
-        ret = modbus_read_holding_regs(client_iface, i, REN_SYS_DEV_ADDR, &buf, 1);
-        LOG_INF("Addr %02x ret %d", i, ret);
+        if (rx_timeout_us == cur_timeout_us) {
+                return 0;
+        }
 
-        if (ret == 0) {
-                LOG_INF("Device responded at %02x with addr %04x", i, buf);
-                return i;
+        ret = modbus_disable(client_iface);
+        if (ret < 0) {
+                return ret;
+        }
+
+        param.rx_timeout = rx_timeout_us;
+        ret = modbus_init_client(client_iface, param);
+        if (ret < 0) {
+                return ret;
         }
+        cur_timeout_us = rx_timeout_us;
 
-        /* Device not found */
-        return -ENOENT;
+        k_msleep(SETTLE_MS);
+
+        return 0;
 }
 
-int charger_get_system(struct renogy_sys_t *buf) {
-        return modbus_read_holding_regs(client_iface, client_addr, REN_SYS_CHARGE_RATING, (uint16_t *)buf, sizeof(struct renogy_sys_t)/2);
+/**
+ * Timeout for any read of a device, from the time it takes to start answering.
+ * The allowance doubles with every read that timed out, as RFC 6298 backs off.
+ */
+static uint32_t dev_timeout_us(const struct dev_link *link) {
+        uint32_t us = TURNAROUND_MAX_US;
+
+        if (link->srtt_us != 0) {
+                us = CLAMP(link->srtt_us + 4 * link->rttvar_us, TURNAROUND_MIN_US, TURNAROUND_MAX_US);
+                us = MIN((uint64_t)us << link->backoff, TURNAROUND_MAX_US);
+        }
+
+        return ROUND_UP(MAX_READ_WIRE_US + us, TIMEOUT_STEP_US);
 }
 
-int charger_get_cur_stats(struct renogy_dyn_statistics_t *buf) {
-        return modbus_read_holding_regs(client_iface, client_addr, REN_DYN_STAT_SOC, (uint16_t *)buf, sizeof(struct renogy_dyn_statistics_t)/2);
+/* Smoothed as TCP does its RTT, RFC 6298 */
+static void update_turnaround(struct dev_link *link, uint32_t us) {
+        int32_t err;
+
+        link->backoff = 0;
+        if (link->srtt_us == 0) {
+                link->srtt_us = MAX(us, 1);
+                link->rttvar_us = us / 2;
+                return;
+        }
+
+        err = (int32_t)us - (int32_t)link->srtt_us;
+        link->srtt_us = MAX((int32_t)link->srtt_us + err / 8, 1);
+        link->rttvar_us += ((int32_t)abs(err) - (int32_t)link->rttvar_us) / 4;
 }
 
-int charger_get_daily_stats(struct renogy_dyn_daily_t *buf) {
-        return modbus_read_holding_regs(client_iface, client_addr, REN_DYN_DAILY_MIN_V, (uint16_t *)buf, sizeof(struct renogy_dyn_daily_t)/2);
+/**
+ * Read registers of a device with a timeout from its observed response times,
+ * retrying timeouts, CRC errors and busy responses with a growing backoff.
+ * The timeout is only updated when the device changes or a read timed out,
+ * see set_timeout(). A read that timed out doubles it for the next read.
+ * After CONFIG_RENOGY_BREAKER_THRESHOLD reads failed in a row, the device is
+ * left alone for CONFIG_RENOGY_BREAKER_OPEN_S. A single attempt with the
+ * maximum timeout then decides whether it is back, so a flaky device can't
+ * hold up the bus and a slow one isn't locked out.
+ *
+ * @return 0, a negative errno, -EHOSTDOWN while the device is left alone, or
+ * a Modbus exception code
+ */
+static int read_regs(const struct renogy_dev *dev, uint16_t start, uint16_t *dst, uint16_t count) {
+        struct dev_link *link = &links[dev - devs];
+        uint32_t wire_us = (READ_REQ_CHARS + READ_RSP_CHARS + 2 * count) * CHAR_US;
+        int attempts = CONFIG_RENOGY_RETRIES + 1;
+        bool timed_out = false;
+        int ret;
+
+        if (link->open_until != 0) {
+                if (k_uptime_get() < link->open_until) {
+                        link->stats.refused++;
+                        return -EHOSTDOWN;
+                }
+                attempts = 1;
+                link->stats.probes++;
+        }
+        link->stats.reads++;
+
+        if (dev != timeout_dev || link->widened ||
+            k_uptime_get() - timeout_set_at > TIMEOUT_REFRESH_MS) {
+                ret = set_timeout(dev_timeout_us(link));
+                if (ret < 0) {
+                        LOG_ERR("Failed to set timeout: %d", ret);
+                        return ret;
+                }
+                timeout_dev = dev;
+                timeout_set_at = k_uptime_get();
+                link->widened = false;
+        }
+
+        for (int i = 0; i < attempts; i++) {
+                uint32_t t0;
+
+                if (i > 0) {
+                        k_msleep(CONFIG_RENOGY_RETRY_BACKOFF_MS << (i - 1));
+                        link->stats.retries++;
+                }
+
+                t0 = k_cycle_get_32();
+                ret = modbus_read_holding_regs(client_iface, dev->addr, start, dst, count);
+                if (ret == 0) {
+                        uint32_t rtt_us = k_cyc_to_us_floor32(k_cycle_get_32() - t0);
+
+                        /* A retry may have caught the late answer to the attempt before */
+                        if (i == 0) {
+                                update_turnaround(link, rtt_us > wire_us ? rtt_us - wire_us : 0);
+                        }
+                        link->backoff = 0;
+                        link->failures = 0;
+                        link->open_until = 0;
+                        return 0;
+                }
+
+                /* The device answered, asking again won't change its mind */
+                if (ret > 0 && ret != MODBUS_EXC_SERVER_DEVICE_BUSY) {
+                        return ret;
+                }
+                if (ret == -ETIMEDOUT) {
+                        timed_out = true;
+                        link->stats.timeouts++;
+                }
+                LOG_DBG("Read of %04x from %d failed: %d, timeout %u us", start, dev->addr, ret,
+                        cur_timeout_us);
+        }
+
+        /* The client only takes the longer timeout from the next read */
+        if (timed_out && link->backoff < MAX_BACKOFF) {
+                uint32_t prev_us = dev_timeout_us(link);
+
+                link->backoff++;
+                link->widened = dev_timeout_us(link) != prev_us;
+        }
+
+        link->failures = MIN(link->failures + 1, UINT8_MAX);
+        if (link->failures >= CONFIG_RENOGY_BREAKER_THRESHOLD) {
+                LOG_WRN("Device at %d failed %d reads, leaving it alone for %d s", dev->addr,
+                        link->failures, CONFIG_RENOGY_BREAKER_OPEN_S);
+                link->open_until = k_uptime_get() + CONFIG_RENOGY_BREAKER_OPEN_S * MSEC_PER_SEC;
+                link->stats.breaker_opens++;
+                /* Whatever was learned no longer holds, the probe allows the maximum */
+                link->srtt_us = 0;
+                link->rttvar_us = 0;
+                link->backoff = 0;
+                link->widened = true;
+        }
+
+        return ret;
 }
 
-int charger_get_hist_stats(struct renogy_dyn_hist_t *buf) {
-        return modbus_read_holding_regs(client_iface, client_addr, REN_DYN_HIST_TOTAL_OP_DAYS, (uint16_t *)buf, sizeof(struct renogy_dyn_hist_t)/2);
+/**
+ * Find out whether and what kind of device answers at an address. A Modbus
+ * exception still means a device is there, just not one with these registers.
+ *
+ * @return 0, -ENOENT if nothing answers, or -ENOTSUP for a device that is
+ * neither a charger nor a BMS
+ */
+static int probe(uint8_t addr, enum renogy_dev_type *type) {
+        uint16_t val;
+        int chg, bms;
+
+        chg = modbus_read_holding_regs(client_iface, addr, REN_SYS_DEV_ADDR, &val, 1);
+        if (chg == 0) {
+                *type = REN_DEV_CHARGER;
+                return 0;
+        }
+
+        /* Asked even after a timeout, a device may ignore registers it doesn't have */
+        bms = modbus_read_holding_regs(client_iface, addr, REN_BMS_CELL_COUNT, &val, 1);
+        if (bms == 0) {
+                *type = REN_DEV_BMS;
+                return 0;
+        }
+
+        return chg > 0 || bms > 0 ? -ENOTSUP : -ENOENT;
 }
 
-int charger_get_state(struct renogy_dyn_status_t *buf) {
-        return modbus_read_holding_regs(client_iface, client_addr, REN_DYN_STATUS, (uint16_t *)buf, sizeof(struct renogy_dyn_status_t)/2);
+static int scan_bus(void) {
+        enum renogy_dev_type type;
+        int ret;
+
+        LOG_INF("Scanning Modbus addresses %d-%d", MODBUS_ADDR_MIN, MODBUS_ADDR_MAX);
+
+        /* Most addresses never answer */
+        ret = set_timeout(CONFIG_RENOGY_SCAN_TIMEOUT_MS * USEC_PER_MSEC);
+        if (ret < 0) {
+                LOG_ERR("Failed to set scan timeout: %d", ret);
+                return ret;
+        }
+
+        num_devs = 0;
+        for (int addr = MODBUS_ADDR_MIN; addr <= MODBUS_ADDR_MAX && num_devs < ARRAY_SIZE(devs); addr++) {
+                ret = probe(addr, &type);
+                if (ret == 0) {
+                        LOG_INF("Found %s at %d", type == REN_DEV_BMS ? "BMS" : "charger", addr);
+                        devs[num_devs].addr = addr;
+                        devs[num_devs].type = type;
+                        num_devs++;
+                } else if (ret == -ENOTSUP) {
+                        LOG_WRN("Ignoring unknown device at %d", addr);
+                }
+        }
+
+        memset(links, 0, sizeof(links));
+        timeout_dev = NULL;
+
+        return set_timeout(client_param.rx_timeout);
 }
 
-int charger_get_bat_info(struct renogy_param_bat_t *buf) {
-        return modbus_read_holding_regs(client_iface, client_addr, REN_PARAM_NOM_CAPACITY, (uint16_t *)buf, sizeof(struct renogy_param_bat_t)/2);
+/** Check every cached device still answers as the same kind of device */
+static bool cache_valid(void) {
+        enum renogy_dev_type type;
+
+        if (num_devs == 0) {
+                return false;
+        }
+
+        for (size_t i = 0; i < num_devs; i++) {
+                if (probe(devs[i].addr, &type) != 0 || type != devs[i].type) {
+                        LOG_WRN("Device at %d is gone", devs[i].addr);
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static int renogy_settings_set(const char *name, size_t len, settings_read_cb read_cb,
+                               void *cb_arg) {
+        ssize_t ret;
+
+        if (strcmp(name, "devs") != 0) {
+                return -ENOENT;
+        }
+        if (len > sizeof(devs) || len % sizeof(devs[0]) != 0) {
+                return -EINVAL;
+        }
+
+        ret = read_cb(cb_arg, devs, len);
+        if (ret < 0) {
+                return ret;
+        }
+        num_devs = len / sizeof(devs[0]);
+
+        return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(renogy, "renogy", NULL, renogy_settings_set, NULL, NULL);
+
+/* Every view is one run of registers, read straight into place */
+static int read_block(const struct renogy_dev *dev, uint16_t addr, void *dst, size_t size) {
+        return read_regs(dev, addr, dst, size / 2);
+}
+
+size_t renogy_dev_count(void) {
+        return num_devs;
+}
+
+const struct renogy_dev *renogy_dev_get(size_t idx) {
+        return idx < num_devs ? &devs[idx] : NULL;
+}
+
+int renogy_get_link_stats(const struct renogy_dev *dev, struct renogy_link_stats *stats) {
+        const struct dev_link *link;
+
+        if (dev < devs || dev >= devs + num_devs) {
+                return -EINVAL;
+        }
+        link = &links[dev - devs];
+
+        *stats = link->stats;
+        stats->timeout_us = dev_timeout_us(link);
+        stats->breaker_open = link->open_until != 0;
+
+        return 0;
+}
+
+int charger_get_system(const struct renogy_dev *dev, struct renogy_sys_view *buf) {
+        return read_block(dev, REN_SYS_CHARGE_RATING, buf, sizeof(*buf));
+}
+
+int charger_get_cur_stats(const struct renogy_dev *dev, struct renogy_stats_view *buf) {
+        return read_block(dev, REN_DYN_STAT_SOC, buf, sizeof(*buf));
+}
+
+int charger_get_daily_stats(const struct renogy_dev *dev, struct renogy_daily_view *buf) {
+        return read_block(dev, REN_DYN_DAILY_MIN_V, buf, sizeof(*buf));
+}
+
+int charger_get_hist_stats(const struct renogy_dev *dev, struct renogy_hist_view *buf) {
+        return read_block(dev, REN_DYN_HIST_TOTAL_OP_DAYS, buf, sizeof(*buf));
+}
+
+int charger_get_state(const struct renogy_dev *dev, struct renogy_status_view *buf) {
+        return read_block(dev, REN_DYN_STATUS, buf, sizeof(*buf));
+}
+
+int charger_get_dyn(const struct renogy_dev *dev, struct renogy_dyn_view *buf) {
+        /* The view mirrors 0x100-0x122, so it is read in place */
+        return read_block(dev, REN_DYN_STAT_SOC, buf, sizeof(*buf));
+}
+
+int charger_get_bat_info(const struct renogy_dev *dev, struct renogy_bat_view *buf) {
+        return read_block(dev, REN_PARAM_NOM_CAPACITY, buf, sizeof(*buf));
+}
+
+int bms_get_status(const struct renogy_dev *dev, struct renogy_bms_view *buf) {
+        return read_block(dev, REN_BMS_CURRENT, buf, sizeof(*buf));
 }
 
 int init_charger(void) {
@@ -75,16 +409,36 @@ int init_charger(void) {
                 LOG_ERR("Could not init modbus client: %d\n", ret);
                 return ret;
         }
+        cur_timeout_us = client_param.rx_timeout;
 
-        k_msleep(100);
+        /* Let the transceiver settle, the first request is otherwise lost */
+        k_msleep(SETTLE_MS);
 
-        ret = find_client();
+        ret = settings_load_subtree("renogy");
+        if (ret < 0) {
+                LOG_ERR("Failed to load cached devices: %d", ret);
+        }
+
+        /* Only scan when the devices seen last time don't answer */
+        if (cache_valid()) {
+                LOG_INF("Using %zu cached devices", num_devs);
+                return num_devs;
+        }
+
+        ret = scan_bus();
         if (ret < 0) {
-                LOG_ERR("Could not detect device");
                 return ret;
         }
-        client_addr = (uint16_t)ret;
 
-        return 0;
-}
+        if (num_devs == 0) {
+                LOG_ERR("Could not detect device");
+                return -ENOENT;
+        }
 
+        ret = settings_save_one("renogy/devs", devs, num_devs * sizeof(devs[0]));
+        if (ret < 0) {
+                LOG_ERR("Failed to cache devices: %d", ret);
+        }
+
+        return num_devs;
+}
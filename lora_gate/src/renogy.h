@@ -3,13 +3,60 @@
 
 #include "renogy_internal.h"
 
+enum renogy_dev_type {
+        REN_DEV_CHARGER,
+        REN_DEV_BMS,
+};
+
+/**
+ * A device on the RS-485 bus
+ */
+struct renogy_dev {
+        uint8_t addr;
+        uint8_t type;           /*< See renogy_dev_type */
+};
+
+/**
+ * Find the devices on the bus. The devices found last time are tried first,
+ * the whole bus is only scanned when one of them doesn't answer.
+ * Requires the settings subsystem to be initialized.
+ *
+ * @return number of devices, or negative error
+ */
 int init_charger(void);
 
-int charger_get_system(struct renogy_sys_t *buf);
-int charger_get_cur_stats(struct renogy_dyn_statistics_t *buf);
-int charger_get_daily_stats(struct renogy_dyn_daily_t *buf);
-int charger_get_hist_stats(struct renogy_dyn_hist_t *buf);
-int charger_get_state(struct renogy_dyn_status_t *buf);
-int charger_get_bat_info(struct renogy_param_bat_t *buf);
+size_t renogy_dev_count(void);
+const struct renogy_dev *renogy_dev_get(size_t idx);
+
+/**
+ * How reads of a device went since the bus was scanned
+ */
+struct renogy_link_stats {
+        uint32_t reads;         /*< Reads put on the bus */
+        uint32_t retries;       /*< Attempts after the first of a read */
+        uint32_t timeouts;      /*< Attempts that timed out */
+        uint32_t refused;       /*< Reads failed straight away by the open breaker */
+        uint32_t breaker_opens; /*< Times the breaker opened */
+        uint32_t probes;        /*< Single attempts made after the breaker was open */
+        uint32_t timeout_us;    /*< Timeout due from the turnaround seen so far */
+        bool breaker_open;      /*< Open or waiting for its probe */
+};
+
+int renogy_get_link_stats(const struct renogy_dev *dev, struct renogy_link_stats *stats);
+
+/*
+ * Each call reads a register block straight into its view, see
+ * renogy_internal.h for the accessors and uplink encoders.
+ */
+int charger_get_system(const struct renogy_dev *dev, struct renogy_sys_view *buf);
+int charger_get_cur_stats(const struct renogy_dev *dev, struct renogy_stats_view *buf);
+int charger_get_daily_stats(const struct renogy_dev *dev, struct renogy_daily_view *buf);
+int charger_get_hist_stats(const struct renogy_dev *dev, struct renogy_hist_view *buf);
+int charger_get_state(const struct renogy_dev *dev, struct renogy_status_view *buf);
+/** Read stats, daily and historical totals and status in one go */
+int charger_get_dyn(const struct renogy_dev *dev, struct renogy_dyn_view *buf);
+int charger_get_bat_info(const struct renogy_dev *dev, struct renogy_bat_view *buf);
+
+int bms_get_status(const struct renogy_dev *dev, struct renogy_bms_view *buf);
 
 #endif /* __RENOGY_H__ */
\ No newline at end of file
@@ -1,10 +1,140 @@
 #ifndef __RENOGY_INTERNAL_H__
 #define __RENOGY_INTERNAL_H__
 
+#include <stddef.h>
 #include <stdint.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/toolchain.h>
 
 /* See e.g. https://www.going-flying.com/blog/files/141/ROVER_MODBUS.pdf */
 
+/*
+ * Register field types. The Modbus client hands registers over in host order,
+ * multi-register values are big-endian (high word first) and byte fields are
+ * the high or low half of a register.
+ *
+ *   U16    one register
+ *   S16    one register, two's complement
+ *   U32    two registers, high word first
+ *   U8H    high byte of a register
+ *   U8L    low byte of a register
+ *   T8H    high byte temperature, sign and magnitude in bit 7 and bits 0-6
+ *   T8L    low byte temperature
+ *   STR16  eight registers of characters, first character in the high byte
+ */
+#define REN_CTYPE_U16           uint16_t
+#define REN_CTYPE_S16           int16_t
+#define REN_CTYPE_U32           uint32_t
+#define REN_CTYPE_U8H           uint8_t
+#define REN_CTYPE_U8L           uint8_t
+#define REN_CTYPE_T8H           int8_t
+#define REN_CTYPE_T8L           int8_t
+#define REN_CTYPE_STR16         const uint16_t *
+
+#define REN_NREGS_U16           1
+#define REN_NREGS_S16           1
+#define REN_NREGS_U32           2
+#define REN_NREGS_U8H           1
+#define REN_NREGS_U8L           1
+#define REN_NREGS_T8H           1
+#define REN_NREGS_T8L           1
+#define REN_NREGS_STR16         8
+
+/* Size in the uplink, where values are little-endian */
+#define REN_SIZE_U16            2
+#define REN_SIZE_S16            2
+#define REN_SIZE_U32            4
+#define REN_SIZE_U8H            1
+#define REN_SIZE_U8L            1
+#define REN_SIZE_T8H            1
+#define REN_SIZE_T8L            1
+#define REN_SIZE_STR16          16
+
+static inline int8_t ren_temp(uint8_t raw) {
+        return (raw & BIT(7)) ? -(int8_t)(raw & 0x7F) : (int8_t)raw;
+}
+
+#define REN_GET_U16(_r, _off)   ((_r)[_off])
+#define REN_GET_S16(_r, _off)   ((int16_t)(_r)[_off])
+#define REN_GET_U32(_r, _off)   (((uint32_t)(_r)[_off] << 16) | (_r)[(_off) + 1])
+#define REN_GET_U8H(_r, _off)   ((uint8_t)((_r)[_off] >> 8))
+#define REN_GET_U8L(_r, _off)   ((uint8_t)((_r)[_off] & 0xFF))
+#define REN_GET_T8H(_r, _off)   ren_temp(REN_GET_U8H(_r, _off))
+#define REN_GET_T8L(_r, _off)   ren_temp(REN_GET_U8L(_r, _off))
+#define REN_GET_STR16(_r, _off) (&(_r)[_off])
+
+static inline uint8_t *ren_put_u8(uint8_t *p, uint8_t val) {
+        *p = val;
+        return p + 1;
+}
+
+static inline uint8_t *ren_put_u16(uint8_t *p, uint16_t val) {
+        sys_put_le16(val, p);
+        return p + 2;
+}
+
+static inline uint8_t *ren_put_u32(uint8_t *p, uint32_t val) {
+        sys_put_le32(val, p);
+        return p + 4;
+}
+
+static inline uint8_t *ren_put_str(uint8_t *p, const uint16_t *regs, size_t nregs) {
+        for (size_t i = 0; i < nregs; i++) {
+                sys_put_be16(regs[i], p);
+                p += 2;
+        }
+        return p;
+}
+
+#define REN_PUT_U16(_p, _r, _off)       ren_put_u16(_p, REN_GET_U16(_r, _off))
+#define REN_PUT_S16(_p, _r, _off)       ren_put_u16(_p, REN_GET_U16(_r, _off))
+#define REN_PUT_U32(_p, _r, _off)       ren_put_u32(_p, REN_GET_U32(_r, _off))
+#define REN_PUT_U8H(_p, _r, _off)       ren_put_u8(_p, REN_GET_U8H(_r, _off))
+#define REN_PUT_U8L(_p, _r, _off)       ren_put_u8(_p, REN_GET_U8L(_r, _off))
+#define REN_PUT_T8H(_p, _r, _off)       ren_put_u8(_p, REN_GET_T8H(_r, _off))
+#define REN_PUT_T8L(_p, _r, _off)       ren_put_u8(_p, REN_GET_T8L(_r, _off))
+#define REN_PUT_STR16(_p, _r, _off)     ren_put_str(_p, &(_r)[_off], REN_NREGS_STR16)
+
+#define REN_ACCESSOR(_blk, _name, _off, _type)                                          \
+        static inline REN_CTYPE_##_type renogy_##_blk##_##_name(                        \
+                const struct renogy_##_blk##_view *v) {                                 \
+                return REN_GET_##_type(v->regs, _off);                                  \
+        }
+
+#define REN_CHECK(_blk, _name, _off, _type)                                             \
+        BUILD_ASSERT((_off) + REN_NREGS_##_type <=                                      \
+                     ARRAY_SIZE(((struct renogy_##_blk##_view *)0)->regs),              \
+                     #_blk "." #_name " is outside the register block");
+
+#define REN_ENCODE(_blk, _name, _off, _type)    p = REN_PUT_##_type(p, v->regs, _off);
+
+#define REN_SIZE_ADD(_blk, _name, _off, _type)  + REN_SIZE_##_type
+
+/** Size of a block in the uplink encoding */
+#define RENOGY_ENCODED_LEN(_fields)     (0 _fields(REN_SIZE_ADD, _))
+
+/**
+ * Define a register block view, which is the block exactly as read from the
+ * device, plus accessors decoding each field in place and an encoder packing
+ * all fields into the uplink format in table order.
+ *
+ * Fields are listed by a macro taking the generator and the block name, with
+ * one `F(blk, name, register offset, type)` entry per field.
+ */
+#define RENOGY_VIEW_DEFINE(_blk, _nregs, _fields)                                       \
+        struct renogy_##_blk##_view {                                                   \
+                uint16_t regs[_nregs];                                                  \
+        };                                                                              \
+        _fields(REN_CHECK, _blk)                                                        \
+        _fields(REN_ACCESSOR, _blk)                                                     \
+        static inline size_t renogy_##_blk##_encode(const struct renogy_##_blk##_view *v,\
+                                                    uint8_t *out) {                     \
+                uint8_t *p = out;                                                       \
+                _fields(REN_ENCODE, _blk)                                               \
+                return p - out;                                                         \
+        }
+
 #define REN_SYS_CHARGE_RATING           0x0A
 #define REN_SYS_DISCHARGE_RATING        0x0B
 #define REN_SYS_MODEL                   0x0C
@@ -13,72 +143,71 @@
 #define REN_SYS_SERIAL                  0x18
 #define REN_SYS_DEV_ADDR                0x1A
 
-struct renogy_sys_t {
-        /* TODO: endianness */
-        uint8_t max_charge_i;
-        uint8_t nom_v;
-        uint8_t prod_type;
-        uint8_t max_discharge_i;
-        char model[16];
-        uint32_t sw_version;
-        uint32_t hw_version;
-        uint32_t serial;
-        uint16_t addr;
-};
-
-#define REN_DYN_STAT_SOC                0x100
+#define REN_SYS_FIELDS(F, b)                                                            \
+        F(b, max_charge_i,      0x00, U8L)                                              \
+        F(b, nom_v,             0x00, U8H)                                              \
+        F(b, prod_type,         0x01, U8L)                                              \
+        F(b, max_discharge_i,   0x01, U8H)                                              \
+        F(b, model,             0x02, STR16)                                            \
+        F(b, sw_version,        0x0A, U32)                                              \
+        F(b, hw_version,        0x0C, U32)                                              \
+        F(b, serial,            0x0E, U32)                                              \
+        F(b, addr,              0x10, U16)
 
-struct renogy_dyn_statistics_t {
-        uint16_t soc_pct;
-        uint16_t bat_dV;
-        uint16_t charge_cA;
-        uint8_t bat_temp_C;
-        uint8_t controller_temp_C;
+RENOGY_VIEW_DEFINE(sys, 17, REN_SYS_FIELDS)
 
-        uint16_t load_dV;
-        uint16_t load_cA;
-        uint16_t load_W;
+#define REN_DYN_STAT_SOC                0x100
 
-        uint16_t solar_dV;
-        uint16_t solar_cA;
-        uint16_t solar_W;
-};
+#define REN_STATS_FIELDS(F, b)                                                          \
+        F(b, soc_pct,           0, U16)                                                 \
+        F(b, bat_dV,            1, U16)                                                 \
+        F(b, charge_cA,         2, U16)                                                 \
+        F(b, bat_temp_C,        3, T8L)                                                 \
+        F(b, controller_temp_C, 3, T8H)                                                 \
+        F(b, load_dV,           4, U16)                                                 \
+        F(b, load_cA,           5, U16)                                                 \
+        F(b, load_W,            6, U16)                                                 \
+        F(b, solar_dV,          7, U16)                                                 \
+        F(b, solar_cA,          8, U16)                                                 \
+        F(b, solar_W,           9, U16)
+
+RENOGY_VIEW_DEFINE(stats, 10, REN_STATS_FIELDS)
 
 #define REN_DYN_DAILY_MIN_V             0x10B
 
 /**
  * Daily totals
  */
-struct renogy_dyn_daily_t {
-        uint16_t min_bat_dV;
-        uint16_t max_bat_dV;
-        uint16_t max_charge_cA;
-        uint16_t max_discharge_cA;
-        uint16_t max_charge_W;
-        uint16_t max_discharge_W;
-
-        /* Total for current day */
-        uint16_t charge_Ah;
-        uint16_t discharge_Ah;
-        uint16_t generation_dWh; /* kWh/10k */
-        uint16_t consumption_dWh;
-};
+#define REN_DAILY_FIELDS(F, b)                                                          \
+        F(b, min_bat_dV,        0, U16)                                                 \
+        F(b, max_bat_dV,        1, U16)                                                 \
+        F(b, max_charge_cA,     2, U16)                                                 \
+        F(b, max_discharge_cA,  3, U16)                                                 \
+        F(b, max_charge_W,      4, U16)                                                 \
+        F(b, max_discharge_W,   5, U16)                                                 \
+        /* Total for current day */                                                     \
+        F(b, charge_Ah,         6, U16)                                                 \
+        F(b, discharge_Ah,      7, U16)                                                 \
+        F(b, generation_dWh,    8, U16) /* kWh/10k */                                   \
+        F(b, consumption_dWh,   9, U16)
+
+RENOGY_VIEW_DEFINE(daily, 10, REN_DAILY_FIELDS)
 
 #define REN_DYN_HIST_TOTAL_OP_DAYS      0x115
 
 /**
  * Cumulative totals
  */
-struct renogy_dyn_hist_t {
-        uint16_t op_days;
-        uint16_t over_discharge_cnt;
-        uint16_t full_charge_cnt;
-
-        uint32_t charge_Ah;
-        uint32_t discharge_Ah;
-        uint32_t generation_dWh; /* kWh/10k */
-        uint32_t consumption_dWh;
-};
+#define REN_HIST_FIELDS(F, b)                                                           \
+        F(b, op_days,           0, U16)                                                 \
+        F(b, over_discharge_cnt, 1, U16)                                                \
+        F(b, full_charge_cnt,   2, U16)                                                 \
+        F(b, charge_Ah,         3, U32)                                                 \
+        F(b, discharge_Ah,      5, U32)                                                 \
+        F(b, generation_dWh,    7, U32) /* kWh/10k */                                   \
+        F(b, consumption_dWh,   9, U32)
+
+RENOGY_VIEW_DEFINE(hist, 11, REN_HIST_FIELDS)
 
 #define REN_DYN_STATUS                  0x120
 
@@ -92,12 +221,29 @@ enum renogy_charge_state_t {
         REN_CHARGE_OVERPOWER,
 };
 
-struct renogy_dyn_status_t {
-        uint8_t charge_state;
-        uint8_t load_status;
+#define REN_DYN_FAULT_STATE             0x121
+
+#define REN_STATUS_FIELDS(F, b)                                                         \
+        F(b, charge_state,      0, U8L)                                                 \
+        F(b, load_status,       0, U8H)                                                 \
+        F(b, faults,            1, U32)
+
+RENOGY_VIEW_DEFINE(status, 3, REN_STATUS_FIELDS)
+
+/**
+ * All dynamic registers, 0x100-0x122, read in one transaction
+ */
+struct renogy_dyn_view {
+        struct renogy_stats_view stats;
+        uint16_t rsvd;
+        struct renogy_daily_view daily;
+        struct renogy_hist_view hist;
+        struct renogy_status_view status;
 };
 
-#define REN_DYN_FAULT_STATE             0x121
+BUILD_ASSERT(offsetof(struct renogy_dyn_view, daily) == (REN_DYN_DAILY_MIN_V - REN_DYN_STAT_SOC) * 2);
+BUILD_ASSERT(offsetof(struct renogy_dyn_view, hist) == (REN_DYN_HIST_TOTAL_OP_DAYS - REN_DYN_STAT_SOC) * 2);
+BUILD_ASSERT(offsetof(struct renogy_dyn_view, status) == (REN_DYN_STATUS - REN_DYN_STAT_SOC) * 2);
 
 #define REN_PARAM_NOM_CAPACITY          0xE002
 
@@ -148,39 +294,50 @@ enum renogy_battery_type_t {
 // 3264
 // 6a00 7800 0500 1e00 7800
 
-/* This struct likely has errors */
-struct renogy_param_bat_t {
-        uint8_t nom_bat_V;
-        uint8_t act_bat_V;
-
-        uint16_t solar_overvolt_dV;
-        uint16_t charge_lim_dV;
-
-        uint16_t bat_type;
-
-        /* The boost voltage shouldn't be higher than the
-         * equalization voltage so something is likely wrong here.
-         * This is more likely some battery limit disconnect voltage
-         * but the boost voltage in the datasheet appears to be missing.
-         */
-        uint16_t boost_dV;
-        uint16_t overvolt_recov_dV;
-        uint16_t float_dV;
-        uint16_t equalizing_dV;
-        uint16_t over_disch_recov_dV;
-        uint16_t boost_recov_dV;
-        uint16_t over_disch_dV;
-        /* "under-voltage threshold" */
-        uint16_t undervolt_warn_dV;
-
-        uint8_t end_discharge_soc;
-        uint8_t end_charge_soc;
-
-        uint16_t over_disch_lim_dV;
-        uint16_t eq_charge_s;
-        uint16_t over_disch_delay_s;
-        uint16_t eq_charge_interval_d;
-        uint16_t boost_charge_s;
-};
+/* This table likely has errors */
+#define REN_BAT_FIELDS(F, b)                                                            \
+        F(b, nom_bat_V,         0, U8L)                                                 \
+        F(b, act_bat_V,         0, U8H)                                                 \
+        F(b, solar_overvolt_dV, 1, U16)                                                 \
+        F(b, charge_lim_dV,     2, U16)                                                 \
+        F(b, bat_type,          3, U16)                                                 \
+        /* The boost voltage shouldn't be higher than the                               \
+         * equalization voltage so something is likely wrong here.                     \
+         * This is more likely some battery limit disconnect voltage                    \
+         * but the boost voltage in the datasheet appears to be missing.                \
+         */                                                                             \
+        F(b, boost_dV,          4, U16)                                                 \
+        F(b, overvolt_recov_dV, 5, U16)                                                 \
+        F(b, float_dV,          6, U16)                                                 \
+        F(b, equalizing_dV,     7, U16)                                                 \
+        F(b, over_disch_recov_dV, 8, U16)                                               \
+        F(b, boost_recov_dV,    9, U16)                                                 \
+        F(b, over_disch_dV,     10, U16)                                                \
+        /* "under-voltage threshold" */                                                 \
+        F(b, undervolt_warn_dV, 11, U16)                                                \
+        F(b, end_discharge_soc, 12, U8L)                                                \
+        F(b, end_charge_soc,    12, U8H)                                                \
+        F(b, over_disch_lim_dV, 13, U16)                                                \
+        F(b, eq_charge_s,       14, U16)                                                \
+        F(b, over_disch_delay_s, 15, U16)                                               \
+        F(b, eq_charge_interval_d, 16, U16)                                             \
+        F(b, boost_charge_s,    17, U16)
+
+RENOGY_VIEW_DEFINE(bat, 18, REN_BAT_FIELDS)
+
+/*
+ * Renogy smart lithium battery BMS
+ */
+#define REN_BMS_CELL_COUNT              5000
+#define REN_BMS_CURRENT                 5042
+
+#define REN_BMS_FIELDS(F, b)                                                            \
+        F(b, current_cA,        0, S16) /* Negative when discharging */                 \
+        F(b, voltage_dV,        1, U16)                                                 \
+        F(b, remaining_mAh,     2, U32)                                                 \
+        F(b, capacity_mAh,      4, U32)                                                 \
+        F(b, cycles,            6, U16)
+
+RENOGY_VIEW_DEFINE(bms, 7, REN_BMS_FIELDS)
 
 #endif /* __RENOGY_INTERNAL_H__ */
\ No newline at end of file
@@ -0,0 +1,163 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <string.h>
+
+#include "app_protocol.h"
+#include "series.h"
+
+LOG_MODULE_REGISTER(series, LOG_LEVEL_INF);
+
+#define WINDOW_MS	(CONFIG_TELEMETRY_SERIES_WINDOW * MSEC_PER_SEC)
+/* Room for the windows of two frames, in case one can't be sent */
+#define NUM_WINDOWS	(2 * CONFIG_TELEMETRY_SERIES_WINDOWS_PER_UPLINK)
+/* Longest encoding of a window: mean, low and high of up to 3 bytes each */
+#define MAX_WINDOW_LEN	(SERIES_NUM_CHANNELS * 3 * 3)
+
+struct series_window {
+	uint16_t min[SERIES_NUM_CHANNELS];
+	uint16_t max[SERIES_NUM_CHANNELS];
+	uint16_t mean[SERIES_NUM_CHANNELS];
+};
+
+/** Window being sampled */
+static struct {
+	uint32_t sum[SERIES_NUM_CHANNELS];
+	uint16_t min[SERIES_NUM_CHANNELS];
+	uint16_t max[SERIES_NUM_CHANNELS];
+	uint16_t samples;
+	int64_t start;
+} cur;
+
+/* Ring of closed windows, the oldest is overwritten when full */
+static struct series_window windows[NUM_WINDOWS];
+static size_t head;
+static size_t count;
+
+static void close_window(void) {
+	struct series_window *win = &windows[(head + count) % NUM_WINDOWS];
+
+	for (int c = 0; c < SERIES_NUM_CHANNELS; c++) {
+		win->min[c] = cur.min[c];
+		win->max[c] = cur.max[c];
+		win->mean[c] = (cur.sum[c] + cur.samples / 2) / cur.samples;
+	}
+
+	if (count == NUM_WINDOWS) {
+		LOG_WRN("Dropping oldest window");
+		head = (head + 1) % NUM_WINDOWS;
+	} else {
+		count++;
+	}
+
+	cur.samples = 0;
+}
+
+void series_add(const struct renogy_stats_view *stats, int64_t now) {
+	const uint16_t val[SERIES_NUM_CHANNELS] = {
+		[SERIES_BAT_DV] = renogy_stats_bat_dV(stats),
+		[SERIES_CHARGE_CA] = renogy_stats_charge_cA(stats),
+		[SERIES_LOAD_W] = renogy_stats_load_W(stats),
+		[SERIES_SOLAR_W] = renogy_stats_solar_W(stats),
+	};
+
+	if (cur.samples > 0 && now - cur.start >= WINDOW_MS) {
+		close_window();
+	}
+
+	if (cur.samples == 0) {
+		cur.start = now;
+		for (int c = 0; c < SERIES_NUM_CHANNELS; c++) {
+			cur.sum[c] = 0;
+			cur.min[c] = UINT16_MAX;
+			cur.max[c] = 0;
+		}
+	}
+
+	for (int c = 0; c < SERIES_NUM_CHANNELS; c++) {
+		cur.sum[c] += val[c];
+		cur.min[c] = MIN(cur.min[c], val[c]);
+		cur.max[c] = MAX(cur.max[c], val[c]);
+	}
+	cur.samples++;
+}
+
+size_t series_pending(void) {
+	return count;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t val) {
+	while (val >= 0x80) {
+		*p++ = (val & 0x7F) | 0x80;
+		val >>= 7;
+	}
+	*p++ = val;
+
+	return p;
+}
+
+static uint8_t *put_zigzag(uint8_t *p, int32_t val) {
+	return put_varint(p, ((uint32_t)val << 1) ^ (uint32_t)(val >> 31));
+}
+
+/* The first window of a frame has absolute means, the others follow on from `prev` */
+static uint8_t *put_window(uint8_t *p, const struct series_window *win,
+			   const struct series_window *prev) {
+	for (int c = 0; c < SERIES_NUM_CHANNELS; c++) {
+		if (prev == NULL) {
+			sys_put_le16(win->mean[c], p);
+			p += 2;
+		} else {
+			p = put_zigzag(p, (int32_t)win->mean[c] - prev->mean[c]);
+		}
+		p = put_varint(p, win->mean[c] - win->min[c]);
+		p = put_varint(p, win->max[c] - win->mean[c]);
+	}
+
+	return p;
+}
+
+size_t series_encode(uint8_t *buf, size_t size, size_t *encoded) {
+	struct lorawan_series_uplink_hdr_t *hdr = (struct lorawan_series_uplink_hdr_t *)buf;
+	const struct series_window *prev = NULL;
+	uint8_t *p = buf + sizeof(*hdr);
+	size_t n = 0;
+
+	*encoded = 0;
+	if (count == 0 || size < sizeof(*hdr)) {
+		return 0;
+	}
+
+	/* Steady readings encode far below the longest encoding, so each is tried */
+	while (n < count && n < UINT8_MAX) {
+		const struct series_window *win = &windows[(head + n) % NUM_WINDOWS];
+		uint8_t enc[MAX_WINDOW_LEN];
+		size_t len = put_window(enc, win, prev) - enc;
+
+		if (p + len > buf + size) {
+			break;
+		}
+		memcpy(p, enc, len);
+		p += len;
+
+		prev = win;
+		n++;
+	}
+
+	if (n == 0) {
+		return 0;
+	}
+
+	hdr->count = n;
+	sys_put_le16(CONFIG_TELEMETRY_SERIES_WINDOW, (uint8_t *)&hdr->window_s);
+	*encoded = n;
+
+	return p - buf;
+}
+
+void series_drop(size_t n) {
+	n = MIN(n, count);
+	head = (head + n) % NUM_WINDOWS;
+	count -= n;
+}
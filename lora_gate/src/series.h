@@ -0,0 +1,33 @@
+#ifndef __SERIES_H__
+#define __SERIES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "renogy.h"
+
+/**
+ * Add a charger sample to the current window, closing the window once it
+ * spans CONFIG_TELEMETRY_SERIES_WINDOW seconds.
+ */
+void series_add(const struct renogy_stats_view *stats, int64_t now);
+
+/** Closed windows not yet reported */
+size_t series_pending(void);
+
+/**
+ * Encode as many pending windows as fit, oldest first, see
+ * LORAWAN_PORT_CHARGER_SERIES. The windows stay pending until dropped with
+ * series_drop() once the frame was accepted.
+ *
+ * @param encoded number of windows encoded, fewer than series_pending() when
+ * the frame is full
+ * @return frame length, 0 if there is nothing to report or not even one
+ * window fits
+ */
+size_t series_encode(uint8_t *buf, size_t size, size_t *encoded);
+
+/** Drop the oldest pending windows, after series_encode() */
+void series_drop(size_t n);
+
+#endif /* __SERIES_H__ */
@@ -0,0 +1,26 @@
+"""Attaches renogy_sim.py to the bench on native_sim and waits for its checks."""
+
+import re
+import subprocess
+import sys
+from pathlib import Path
+
+from twister_harness import DeviceAdapter
+
+SIM = Path(__file__).resolve().parents[2] / "common" / "scripts" / "renogy_sim.py"
+
+
+def test_renogy_bench(dut: DeviceAdapter):
+    lines = dut.readlines_until(regex=r"uart_1 connected to pseudotty: ", timeout=30)
+    port = re.search(r"pseudotty: (\S+)", lines[-1]).group(1)
+
+    # No random faults, the checks script their own
+    sim = subprocess.Popen([sys.executable, str(SIM), "--port", port, "--bms", "48", "--seed", "1"])
+    try:
+        lines = dut.readlines_until(regex=r"Checks passed|checks FAILED|No devices found",
+                                    timeout=240)
+    finally:
+        sim.terminate()
+        sim.wait()
+
+    assert "Checks passed" in lines[-1], "\n".join(lines)
@@ -0,0 +1,312 @@
+/*
+ * Times the Renogy Modbus poller against simulated devices, see
+ * common/scripts/renogy_sim.py for the simulator and its fault injection.
+ * Then checks the retries, the circuit breaker and the timeouts of the first
+ * device against faults scripted in the simulator.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/modbus/modbus.h>
+#include <zephyr/settings/settings.h>
+
+#include "renogy.h"
+
+LOG_MODULE_REGISTER(bench, LOG_LEVEL_INF);
+
+#define MODBUS_NODE DT_COMPAT_GET_ANY_STATUS_OKAY(zephyr_modbus_serial)
+
+/* Simulator only register and its scripted faults, see renogy_sim.py */
+#define SIM_FAULT_REG		0xFF00
+#define FAULT_NONE		0
+#define FAULT_ALTERNATE		1
+#define FAULT_OUTAGE		2
+
+/* Reads made while every other request is dropped */
+#define RETRY_READS		5
+/* renogy.c rounds timeouts up to this */
+#define TIMEOUT_STEP_US		(5 * USEC_PER_MSEC)
+
+static int checks_failed;
+
+#define CHECK(cond, fmt, ...)							\
+	do {									\
+		if (!(cond)) {							\
+			LOG_ERR("Check failed: " fmt, ##__VA_ARGS__);		\
+			checks_failed++;					\
+		}								\
+	} while (0)
+
+struct bench_case {
+	const char *name;
+	enum renogy_dev_type type;
+	int (*read)(const struct renogy_dev *dev);
+};
+
+static int read_dyn(const struct renogy_dev *dev) {
+	struct renogy_dyn_view view;
+
+	return charger_get_dyn(dev, &view);
+}
+
+/* What charger_get_dyn merges into one transaction */
+static int read_dyn_split(const struct renogy_dev *dev) {
+	struct renogy_dyn_view view;
+	int ret;
+
+	ret = charger_get_cur_stats(dev, &view.stats);
+	if (ret == 0) {
+		ret = charger_get_daily_stats(dev, &view.daily);
+	}
+	if (ret == 0) {
+		ret = charger_get_hist_stats(dev, &view.hist);
+	}
+	if (ret == 0) {
+		ret = charger_get_state(dev, &view.status);
+	}
+
+	return ret;
+}
+
+static int read_sys(const struct renogy_dev *dev) {
+	struct renogy_sys_view view;
+
+	return charger_get_system(dev, &view);
+}
+
+static int read_bat(const struct renogy_dev *dev) {
+	struct renogy_bat_view view;
+
+	return charger_get_bat_info(dev, &view);
+}
+
+static int read_bms(const struct renogy_dev *dev) {
+	struct renogy_bms_view view;
+
+	return bms_get_status(dev, &view);
+}
+
+static const struct bench_case cases[] = {
+	{ "dyn", REN_DEV_CHARGER, read_dyn },
+	{ "dyn split", REN_DEV_CHARGER, read_dyn_split },
+	{ "system", REN_DEV_CHARGER, read_sys },
+	{ "battery", REN_DEV_CHARGER, read_bat },
+	{ "bms", REN_DEV_BMS, read_bms },
+};
+
+static void run_case(const struct bench_case *c, const struct renogy_dev *dev) {
+	uint32_t ok = 0, failed = 0;
+	uint32_t min_us = UINT32_MAX, max_us = 0;
+	uint64_t total_us = 0;
+	int last_err = 0;
+
+	for (int i = 0; i < CONFIG_RENOGY_BENCH_ROUNDS; i++) {
+		uint32_t start = k_cycle_get_32();
+		int ret = c->read(dev);
+		uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+		if (ret != 0) {
+			failed++;
+			last_err = ret;
+			continue;
+		}
+		ok++;
+		total_us += us;
+		min_us = MIN(min_us, us);
+		max_us = MAX(max_us, us);
+	}
+
+	LOG_INF("%3d %-10s ok %4u failed %4u (%d) min %7u avg %7u max %7u us", dev->addr, c->name,
+		ok, failed, last_err, ok ? min_us : 0, ok ? (uint32_t)(total_us / ok) : 0, max_us);
+}
+
+static int sim_fault(const struct renogy_dev *dev, uint16_t fault) {
+	int iface = modbus_iface_get_by_name(DEVICE_DT_NAME(MODBUS_NODE));
+	int ret;
+
+	/* Shares the client renogy.c set up, the simulator always answers this */
+	ret = modbus_write_holding_reg(iface, dev->addr, SIM_FAULT_REG, fault);
+	if (ret != 0) {
+		LOG_ERR("Simulator at %d didn't take fault %d: %d", dev->addr, fault, ret);
+		checks_failed++;
+	}
+
+	return ret;
+}
+
+static void get_stats(const struct renogy_dev *dev, struct renogy_link_stats *stats) {
+	int ret = renogy_get_link_stats(dev, stats);
+
+	CHECK(ret == 0, "no link stats for %d: %d", dev->addr, ret);
+}
+
+/* The first read of a device, which the checks go through */
+static const struct bench_case *dev_read(const struct renogy_dev *dev) {
+	for (size_t i = 0; i < ARRAY_SIZE(cases); i++) {
+		if (cases[i].type == dev->type) {
+			return &cases[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void check_retries(const struct renogy_dev *dev, const struct bench_case *c) {
+	struct renogy_link_stats before, after;
+	int ret;
+
+	get_stats(dev, &before);
+	if (sim_fault(dev, FAULT_ALTERNATE) != 0) {
+		return;
+	}
+
+	/* Each first attempt is dropped and its retry answered */
+	for (int i = 0; i < RETRY_READS; i++) {
+		ret = c->read(dev);
+		CHECK(ret == 0, "read %d with a dropped attempt: %d", i, ret);
+	}
+	get_stats(dev, &after);
+
+	CHECK(after.retries - before.retries == RETRY_READS, "%u retries for %d reads",
+	      after.retries - before.retries, RETRY_READS);
+	CHECK(after.timeouts - before.timeouts == RETRY_READS, "%u timeouts for %d reads",
+	      after.timeouts - before.timeouts, RETRY_READS);
+	CHECK(after.breaker_opens == before.breaker_opens, "breaker opened on retried reads");
+
+	sim_fault(dev, FAULT_NONE);
+}
+
+/**
+ * Takes the device down until the breaker opens, then checks the breaker
+ * refuses reads, reopens when its probe fails and closes when it succeeds.
+ */
+static void check_breaker(const struct renogy_dev *dev, const struct bench_case *c) {
+	struct renogy_link_stats before, after;
+	uint32_t learned_us, open_us, prev_us;
+	int ret;
+
+	/* Learn the turnaround of the healthy device first */
+	for (int i = 0; i < RETRY_READS; i++) {
+		c->read(dev);
+	}
+	get_stats(dev, &before);
+	learned_us = prev_us = before.timeout_us;
+
+	if (sim_fault(dev, FAULT_OUTAGE) != 0) {
+		return;
+	}
+
+	for (int i = 0; i < CONFIG_RENOGY_BREAKER_THRESHOLD; i++) {
+		ret = c->read(dev);
+		CHECK(ret == -ETIMEDOUT, "read %d in an outage: %d", i, ret);
+
+		/* Backs off, and an open breaker allows the maximum */
+		get_stats(dev, &after);
+		CHECK(after.timeout_us >= prev_us, "timeout shrank from %u to %u us in an outage",
+		      prev_us, after.timeout_us);
+		prev_us = after.timeout_us;
+	}
+	open_us = after.timeout_us;
+
+	CHECK(after.breaker_open, "breaker closed after %d failed reads",
+	      CONFIG_RENOGY_BREAKER_THRESHOLD);
+	CHECK(after.breaker_opens - before.breaker_opens == 1, "breaker opened %u times",
+	      after.breaker_opens - before.breaker_opens);
+	CHECK(after.retries - before.retries == CONFIG_RENOGY_BREAKER_THRESHOLD * CONFIG_RENOGY_RETRIES,
+	      "%u retries for %d failed reads", after.retries - before.retries,
+	      CONFIG_RENOGY_BREAKER_THRESHOLD);
+
+	/* The allowance stays within the turnaround range, on top of the same wire time */
+	CHECK(learned_us < open_us, "learned timeout %u us not below the %u us of an unknown device",
+	      learned_us, open_us);
+	CHECK(open_us - learned_us <= (CONFIG_RENOGY_TURNAROUND_MAX_MS -
+				       CONFIG_RENOGY_TURNAROUND_MIN_MS) * USEC_PER_MSEC + TIMEOUT_STEP_US,
+	      "learned timeout %u us below the least turnaround, %u us maximum", learned_us, open_us);
+
+	/* Open, reads fail without touching the bus */
+	before = after;
+	ret = c->read(dev);
+	get_stats(dev, &after);
+	CHECK(ret == -EHOSTDOWN, "read with the breaker open: %d", ret);
+	CHECK(after.refused - before.refused == 1 && after.reads == before.reads,
+	      "breaker let a read through");
+
+	/* Half open, a single attempt that fails opens it again */
+	k_sleep(K_SECONDS(CONFIG_RENOGY_BREAKER_OPEN_S));
+	before = after;
+	ret = c->read(dev);
+	get_stats(dev, &after);
+	CHECK(ret == -ETIMEDOUT, "failed probe: %d", ret);
+	CHECK(after.probes - before.probes == 1 && after.retries == before.retries,
+	      "probe retried %u times", after.retries - before.retries);
+	CHECK(after.breaker_open && after.breaker_opens - before.breaker_opens == 1,
+	      "breaker not reopened after a failed probe");
+	CHECK(after.timeout_us == open_us, "probe timeout %u us, expected %u us", after.timeout_us,
+	      open_us);
+
+	if (sim_fault(dev, FAULT_NONE) != 0) {
+		return;
+	}
+
+	/* Half open again, a probe that succeeds closes it */
+	k_sleep(K_SECONDS(CONFIG_RENOGY_BREAKER_OPEN_S));
+	before = after;
+	ret = c->read(dev);
+	get_stats(dev, &after);
+	CHECK(ret == 0, "probe of a device that is back: %d", ret);
+	CHECK(after.probes - before.probes == 1 && !after.breaker_open, "breaker still open");
+	CHECK(after.timeout_us < open_us, "timeout %u us not relearned after the outage",
+	      after.timeout_us);
+
+	ret = c->read(dev);
+	CHECK(ret == 0, "read after the breaker closed: %d", ret);
+}
+
+int main(void) {
+	int64_t start;
+	int ret;
+
+	ret = settings_subsys_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to initialize settings: %d", ret);
+		return ret;
+	}
+
+	LOG_INF("Waiting %d s for renogy_sim.py to attach to the uart_1 pty",
+		CONFIG_RENOGY_BENCH_ATTACH_DELAY);
+	k_sleep(K_SECONDS(CONFIG_RENOGY_BENCH_ATTACH_DELAY));
+
+	start = k_uptime_get();
+	ret = init_charger();
+	if (ret <= 0) {
+		LOG_ERR("No devices found: %d", ret);
+		return ret;
+	}
+	LOG_INF("Found %d devices in %lld ms", ret, k_uptime_get() - start);
+
+	for (size_t i = 0; i < renogy_dev_count(); i++) {
+		const struct renogy_dev *dev = renogy_dev_get(i);
+
+		for (size_t j = 0; j < ARRAY_SIZE(cases); j++) {
+			if (cases[j].type == dev->type) {
+				run_case(&cases[j], dev);
+			}
+		}
+	}
+
+	if (IS_ENABLED(CONFIG_RENOGY_BENCH_CHECKS)) {
+		const struct renogy_dev *dev = renogy_dev_get(0);
+
+		LOG_INF("Checking retries and the breaker on %d", dev->addr);
+		check_retries(dev, dev_read(dev));
+		check_breaker(dev, dev_read(dev));
+
+		if (checks_failed) {
+			LOG_ERR("%d checks FAILED", checks_failed);
+			return -EIO;
+		}
+		LOG_INF("Checks passed");
+	}
+
+	return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Times the LoRaMac secure element operations: the MIC, payload encryption
+ * and join accept processing. Built with the Semtech soft secure element, or
+ * with common/lorawan/se.c on PSA crypto with psa.conf, see common/build.txt.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include <string.h>
+
+#include "LoRaMacHeaderTypes.h"
+#include "secure-element.h"
+#include "secure-element-nvm.h"
+
+#include "keys.h"
+
+LOG_MODULE_REGISTER(bench, LOG_LEVEL_INF);
+
+#ifdef CONFIG_BOARD_NATIVE_SIM
+uint32_t se_bench_host_ns(void);
+
+#define STAMP()		se_bench_host_ns()
+#define STAMP_NS(d)	((uint64_t)(d))
+#else
+#define STAMP()		k_cycle_get_32()
+#define STAMP_NS(d)	k_cyc_to_ns_floor64(d)
+#endif
+
+#ifdef CONFIG_HAS_PSA_STORAGE_SE
+#ifdef CONFIG_ESP32S3_AES_ALT
+#define BACKEND		"PSA, AES peripheral"
+#else
+#define BACKEND		"PSA"
+#endif
+#else
+#define BACKEND		"soft"
+#endif
+
+#define BLOCK		16
+/* MHDR, FHDR without FOpts and FPort in front of the payload */
+#define FRAME_HDR	9
+#define MAX_PAYLOAD	242
+
+/* The largest payloads of the US915 and EU868 datarates */
+static const uint16_t payload_sizes[] = { 11, 51, 115, 222, MAX_PAYLOAD };
+
+/* FIPS-197 appendix C.1 */
+static const uint8_t ecb_key[BLOCK] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+static const uint8_t ecb_plain[BLOCK] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+	0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+};
+static const uint8_t ecb_cipher[BLOCK] = {
+	0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+	0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a,
+};
+
+/* RFC 4493 example 3, the first block passed as the B0 block */
+static const uint8_t cmac_key[BLOCK] = {
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+	0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+static const uint8_t cmac_msg[40] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+	0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+	0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+};
+static const uint32_t cmac_mic = 0x4767a6df;
+
+/* Not provisioned, se.c only hands them to LoRaMac */
+static uint8_t test_eui[8];
+static uint8_t test_key[BLOCK];
+
+uint8_t *get_join_eui(void) {
+	return test_eui;
+}
+
+uint8_t *get_dev_eui(void) {
+	return test_eui;
+}
+
+uint8_t *get_app_key(void) {
+	return test_key;
+}
+
+uint8_t *get_nwk_key(void) {
+	return test_key;
+}
+
+static SecureElementNvmData_t se_nvm;
+static uint8_t frame[FRAME_HDR + MAX_PAYLOAD];
+static uint8_t join_accept[LORAMAC_JOIN_ACCEPT_FRAME_MAX_SIZE];
+static uint8_t dec_join_accept[LORAMAC_JOIN_ACCEPT_FRAME_MAX_SIZE];
+
+struct bench_case {
+	const char *name;
+	SecureElementStatus_t expected;
+	SecureElementStatus_t (*op)(uint16_t size);
+};
+
+/* As LoRaMacCrypto encrypts a payload, one block at a time */
+static SecureElementStatus_t payload_encrypt(uint16_t size) {
+	uint8_t a_block[BLOCK] = { 0x01 };
+	uint8_t s_block[BLOCK];
+	uint8_t *buf = frame + FRAME_HDR;
+	SecureElementStatus_t ret;
+
+	for (uint16_t i = 0; i < size; i += BLOCK) {
+		a_block[15] = i / BLOCK + 1;
+		ret = SecureElementAesEncrypt(a_block, BLOCK, APP_S_KEY, s_block);
+		if (ret != SECURE_ELEMENT_SUCCESS) {
+			return ret;
+		}
+		for (uint16_t j = 0; j < BLOCK && i + j < size; j++) {
+			buf[i + j] ^= s_block[j];
+		}
+	}
+
+	return SECURE_ELEMENT_SUCCESS;
+}
+
+static SecureElementStatus_t frame_mic(uint16_t size) {
+	uint8_t b0[BLOCK] = { 0x49 };
+	uint32_t mic;
+
+	b0[15] = FRAME_HDR + size;
+
+	return SecureElementComputeAesCmac(b0, frame, FRAME_HDR + size, F_NWK_S_INT_KEY, &mic);
+}
+
+static SecureElementStatus_t process_join_accept(uint16_t size) {
+	uint8_t version;
+
+	return SecureElementProcessJoinAccept(JOIN_REQ, test_eui, 0, join_accept, size,
+					      dec_join_accept, &version);
+}
+
+static const struct bench_case cases[] = {
+	{ "encrypt", SECURE_ELEMENT_SUCCESS, payload_encrypt },
+	{ "mic", SECURE_ELEMENT_SUCCESS, frame_mic },
+	/* The MIC can't be made to match without AES decryption, but the work is the same */
+	{ "join accept", SECURE_ELEMENT_FAIL_CMAC, process_join_accept },
+};
+
+/** @return number of operations that didn't return what they should */
+static uint32_t run_case(const struct bench_case *c, uint16_t size) {
+	uint64_t total_ns = 0, min_ns = UINT64_MAX, max_ns = 0;
+	uint32_t failed = 0;
+
+	for (int i = 0; i < CONFIG_SE_BENCH_ROUNDS; i++) {
+		uint32_t start = STAMP();
+		SecureElementStatus_t ret = c->op(size);
+		uint64_t ns = STAMP_NS(STAMP() - start);
+
+		if (ret != c->expected) {
+			failed++;
+		}
+		total_ns += ns;
+		min_ns = MIN(min_ns, ns);
+		max_ns = MAX(max_ns, ns);
+	}
+
+	LOG_INF("%-11s %3u bytes: min %6u avg %6u max %6u us, %6u kB/s%s", c->name, size,
+		(uint32_t)(min_ns / NSEC_PER_USEC),
+		(uint32_t)(total_ns / CONFIG_SE_BENCH_ROUNDS / NSEC_PER_USEC),
+		(uint32_t)(max_ns / NSEC_PER_USEC),
+		(uint32_t)(total_ns ? (uint64_t)size * CONFIG_SE_BENCH_ROUNDS * NSEC_PER_MSEC / total_ns : 0),
+		failed ? " FAILED" : "");
+
+	return failed;
+}
+
+/* Known answers first, timing a broken backend is pointless */
+static int self_test(void) {
+	uint8_t out[BLOCK];
+	uint32_t mic;
+	int ret;
+
+	ret = SecureElementAesEncrypt((uint8_t *)ecb_plain, BLOCK, APP_S_KEY, out);
+	if (ret != SECURE_ELEMENT_SUCCESS || memcmp(out, ecb_cipher, BLOCK) != 0) {
+		LOG_ERR("AES known answer failed: %d", ret);
+		return -EIO;
+	}
+
+	ret = SecureElementComputeAesCmac((uint8_t *)cmac_msg, (uint8_t *)cmac_msg + BLOCK,
+					  sizeof(cmac_msg) - BLOCK, F_NWK_S_INT_KEY, &mic);
+	if (ret != SECURE_ELEMENT_SUCCESS || mic != cmac_mic) {
+		LOG_ERR("CMAC known answer failed: %d, %08x", ret, mic);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Find an encrypted join accept that decrypts to LoRaWAN 1.0, so it is
+ * processed as such rather than rejected for its version.
+ */
+static int make_join_accept(void) {
+	uint8_t block[BLOCK];
+
+	join_accept[0] = 0x20;
+	for (int i = 0; i < 256; i++) {
+		join_accept[1] = i;
+		if (SecureElementAesEncrypt(join_accept + 1, BLOCK, NWK_KEY, block) != SECURE_ELEMENT_SUCCESS) {
+			return -EIO;
+		}
+		/* DLSettings */
+		if ((block[10] & 0x80) == 0) {
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+int main(void) {
+	uint32_t failed = 0;
+	int ret;
+
+	LOG_INF("Secure element: %s, %d rounds", BACKEND, CONFIG_SE_BENCH_ROUNDS);
+
+	ret = SecureElementInit(&se_nvm);
+	if (ret != SECURE_ELEMENT_SUCCESS) {
+		LOG_ERR("Failed to initialize secure element: %d", ret);
+		return -EIO;
+	}
+
+	if (SecureElementSetKey(APP_S_KEY, (uint8_t *)ecb_key) != SECURE_ELEMENT_SUCCESS ||
+	    SecureElementSetKey(F_NWK_S_INT_KEY, (uint8_t *)cmac_key) != SECURE_ELEMENT_SUCCESS ||
+	    SecureElementSetKey(NWK_KEY, (uint8_t *)cmac_key) != SECURE_ELEMENT_SUCCESS) {
+		LOG_ERR("Failed to set keys");
+		return -EIO;
+	}
+
+	ret = self_test();
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = make_join_accept();
+	if (ret < 0) {
+		LOG_ERR("Failed to make join accept: %d", ret);
+		return ret;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(payload_sizes); i++) {
+		failed += run_case(&cases[0], payload_sizes[i]);
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(payload_sizes); i++) {
+		failed += run_case(&cases[1], payload_sizes[i]);
+	}
+	/* Without and with a CFList */
+	failed += run_case(&cases[2], LORAMAC_JOIN_ACCEPT_FRAME_MAX_SIZE - BLOCK);
+	failed += run_case(&cases[2], LORAMAC_JOIN_ACCEPT_FRAME_MAX_SIZE);
+
+	if (failed) {
+		LOG_ERR("%u operations FAILED", failed);
+		return -EIO;
+	}
+	LOG_INF("Secure element bench passed");
+
+	return 0;
+}